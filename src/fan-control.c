@@ -29,24 +29,154 @@ SOFTWARE.
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/select.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <libgen.h>
+#include <signal.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "lib/tiny-json.h"
+#include "log.h"
+#include "sysfs-read.h"
+#include "thermal-model.h"
+#include "trace.h"
+#include "status-page.h"
+
+TRACE_SEMAPHORE(sensor_read);
+TRACE_SEMAPHORE(decision);
+TRACE_SEMAPHORE(actuate);
+TRACE_SEMAPHORE(config_load);
 
 #define TMP_BUFF_LEN_32 32
 #define MAX_CONF_FILE_SIZE 4096
+#define DEFAULT_LOG_PATH "/var/log/fan-control.log"
+#define MAX_STATE_FILE_SIZE 4096
+
+/* compile-time limits, all tables are sized by them */
+#ifndef MAX_TEMP_MAP_SIZE
+#define MAX_TEMP_MAP_SIZE 32
+#endif
+
+#ifndef MAX_CPUFREQ_POLICY
+#define MAX_CPUFREQ_POLICY 8
+#endif
+
+/*
+ * FAN_CONTROL_FIXED_MEMORY: parse buffers live in static storage instead of the
+ * stack, memory is locked at startup and every heap allocation after init is
+ * counted, so the footprint stays constant for the lifetime of the daemon.
+ */
+#ifdef FAN_CONTROL_FIXED_MEMORY
+#define FIXED_STORAGE static
+#define STACK_PAINT_SIZE (128 * 1024)
+#else
+#define FIXED_STORAGE
+#endif
 
 int pidfile_fd = 0;
 int pwmchip_id = -1;
 int pwmchip_gpio_id = 0;
 int pwm_period = 10000;
 int fan_mode = 0;
+int throttle_detect = 1;
+int loop_interval_ms = 1000;
+int use_io_uring = 0;
+int log_level = TLOG_INFO;
+int log_output = -1;
+char log_file[1024] = DEFAULT_LOG_PATH;
+
+/* duty dithering between adjacent counts of the 0-255 hwmon range */
+int dither_enable = 0;
+int dither_interval = 1000;
+double dither_error = 0;
+int dither_written = -1;
+unsigned long long dither_last_ms = 0;
 
 #define DEFAULT_PID_PATH "/run/fan-control.pid"
 #define DEFAULT_CONF_PATH "/etc/fan-control.json"
+#define DEFAULT_STATUS_PATH "/run/fan-control.status"
+#define DEFAULT_HANDOVER_PATH "/run/fan-control.state"
+#define DEFAULT_AUTO_TUNE_PATH "/var/lib/fan-control/temp-map.json"
 
 #define FAN_PWM_PATH "/sys/devices/platform/fd8b0010.pwm/pwm"
+#define FAN_HWMON_PATH "/sys/devices/platform/pwm-fan/hwmon"
+#define DEFAULT_CALIBRATION_PATH "/var/lib/fan-control/fan-calibration.json"
+#define DEFAULT_EFFICIENCY_PATH "/var/lib/fan-control/efficiency.json"
 #define TEMP_PATH "/sys/class/thermal/thermal_zone0/temp"
+#define THERMAL_ZONE_PATH "/sys/class/thermal"
+#define HWMON_PATH "/sys/class/hwmon"
+#define CPU_PATH "/sys/devices/system/cpu"
+#define CPUFREQ_PATH CPU_PATH "/cpufreq"
+
+/* cpuinfo_cur_freq lower than scaling_cur_freq by more than this percent is throttling */
+#define THROTTLE_FREQ_TOLERANCE 5
+/* the two frequency files are read at different moments and differ during DVFS transitions */
+#define THROTTLE_FREQ_SAMPLES 3
+
+struct cpufreq_policy_struct
+{
+    int id;
+    int fd_cur;
+    int fd_hw;
+    int fd_max;
+    int fd_throttle;
+    int id_cur;
+    int id_hw;
+    int id_max;
+    int id_throttle;
+    long long base_max;
+    long long throttle_count;
+    long long min_freq;
+    long long cap;
+    int slow_samples;
+    char max_path[640];
+    char restore_value[24];
+};
+
+struct cpufreq_policy_struct cpufreq_policy[MAX_CPUFREQ_POLICY];
+int cpufreq_policy_num = 0;
+int throttle_active = 0;
+unsigned long long throttle_ms = 0;
+
+/* passive cooling: cap scaling_max_freq while the fan is saturated and the temperature still rises */
+int passive_ceiling = 0;
+int passive_hysteresis = 3;
+int passive_step = 10;
+int passive_floor = 50;
+int passive_level = 0;
+
+/*
+ * Cooling efficiency: effective thermal resistance, the rise above ambient
+ * per unit of load, fitted through the origin with exponentially decayed
+ * sums for every sensor and fan level. The first estimate that has seen
+ * enough samples becomes the baseline; drift beyond the limit is a fault.
+ */
+struct efficiency_struct
+{
+    double sxx;
+    double sxy;
+    double seconds;
+    double baseline;
+};
+
+int efficiency_enable = 0;
+int efficiency_ambient = 25;
+int efficiency_half_life = 3600;
+int efficiency_drift = 20;
+int efficiency_warmup = 1800;
+char efficiency_file[1024] = DEFAULT_EFFICIENCY_PATH;
 
 struct temp_map_struct
 {
@@ -54,521 +184,5544 @@ struct temp_map_struct
     int temp;
     int duty;
     int duration;
+    int percent;
 };
 
 struct temp_map_struct default_temp_map[] = {
-    {0, 40, 0, 20},
-    {1, 44, 5500, 25},
-    {2, 49, 6000, 35},
-    {3, 54, 7000, 45},
-    {4, 59, 8000, 60},
-    {5, 64, 9000, 120},
-    {6, 67, 10000, 180},
+    {0, 40, 0, 20, 0},
+    {1, 44, 5500, 25, 55},
+    {2, 49, 6000, 35, 60},
+    {3, 54, 7000, 45, 70},
+    {4, 59, 8000, 60, 80},
+    {5, 64, 9000, 120, 90},
+    {6, 67, 10000, 180, 100},
 };
 
 int default_temp_map_size = sizeof(default_temp_map) / sizeof(struct temp_map_struct);
+struct temp_map_struct temp_map_storage[MAX_TEMP_MAP_SIZE];
 struct temp_map_struct *temp_map = default_temp_map;
 int temp_map_size = sizeof(default_temp_map) / sizeof(struct temp_map_struct);
 
-int write_value(const char *file, const char *value)
+/* hysteresis state of a curve, the active one or a shadow */
+struct curve_state_struct
+{
+    int last_speed;
+    int last_temperature;
+    int count;
+};
+
+#define MAX_SHADOW_CURVES 4
+#define CURVE_STATS_THRESHOLDS 4
+
+/* fan energy and wear of a curve: duty integral, level changes and time spent at high duty */
+struct curve_stats_struct
+{
+    double duty_seconds;
+    unsigned long actuations;
+    unsigned long long above_ms[CURVE_STATS_THRESHOLDS];
+    int last_speed;
+};
+
+const int curve_stats_threshold[CURVE_STATS_THRESHOLDS] = {25, 50, 75, 100};
+
+/* a candidate curve evaluated on the live samples, it never drives the fan */
+struct shadow_curve_struct
+{
+    char name[32];
+    struct temp_map_struct map[MAX_TEMP_MAP_SIZE];
+    int map_size;
+    struct curve_state_struct state;
+    struct curve_stats_struct stats;
+};
+
+struct curve_state_struct active_curve_state = {-1, -1, 0};
+struct curve_stats_struct active_curve_stats = {0, 0, {0}, -1};
+struct shadow_curve_struct shadow_curve[MAX_SHADOW_CURVES];
+int shadow_curve_num = 0;
+
+#define MAX_PROFILES 8
+#define CGROUP_PATH "/sys/fs/cgroup"
+
+/* a workload cgroup that, while populated, raises the fan before the temperature moves */
+struct profile_struct
+{
+    char name[32];
+    char cgroup[512];
+    int floor;
+    int temp_offset;
+    int revert_delay;
+    int wd_events;
+    int wd_parent;
+    int populated;
+    int active;
+    unsigned long long exit_ms;
+};
+
+struct profile_struct profile[MAX_PROFILES];
+int profile_num = 0;
+int profile_inotify_fd = -1;
+int profile_floor_speed = 0;
+int profile_temp_offset = 0;
+
+#define MAX_LEASES 16
+#define DEFAULT_LEASE_PATH "/run/fan-control.sock"
+
+enum lease_type
+{
+    LEASE_FLOOR,
+    LEASE_TARGET,
+};
+
+/* a client's request for headroom: a duty floor, or full cooling until the temperature is at or below a target */
+struct lease_struct
+{
+    unsigned int id;
+    int type;
+    int value;
+    unsigned long long expire_ms;
+};
+
+struct lease_struct lease[MAX_LEASES];
+int lease_num = 0;
+int lease_enable = 0;
+int lease_max = 4;
+int lease_max_duration = 600;
+char lease_socket[108] = DEFAULT_LEASE_PATH;
+int lease_fd = -1;
+unsigned int lease_next_id = 1;
+
+volatile sig_atomic_t show_memory_request = 0;
+
+#define MAX_CALIBRATION_POINTS 21
+#define CALIBRATION_STEP 5
+
+/* steady-state fan speed against hardware duty, measured by --characterize */
+struct fan_calibration_struct
+{
+    int valid;
+    int start_duty;
+    int stall_duty;
+    int max_rpm;
+    int count;
+    int duty[MAX_CALIBRATION_POINTS];
+    int rpm[MAX_CALIBRATION_POINTS];
+};
+
+#define MAX_FALLBACK_SENSORS 4
+
+enum fault_flag_type
+{
+    FAULT_SENSOR = 1 << 0,
+    FAULT_SENSOR_IMPLAUSIBLE = 1 << 1,
+    FAULT_SENSOR_LOST = 1 << 2,
+    FAULT_ACTUATOR = 1 << 3,
+    FAULT_COOLING_DRIFT = 1 << 4,
+    FAULT_LOOP_STALL = 1 << 5,
+};
+
+/* fault handling: sensor retries, fallback sensors and the duty used when all else fails */
+int failsafe_temp_min = 0;
+int failsafe_temp_max = 150;
+int failsafe_retries = 3;
+int failsafe_safe_duty = 100;
+int failsafe_write_faults = 3;
+int fallback_sensor_num = 0;
+char fallback_sensor_path[MAX_FALLBACK_SENSORS][1024];
+int fallback_sensor_fd[MAX_FALLBACK_SENSORS];
+atomic_int fault_flags;
+atomic_int actuator_failures;
+char failsafe_file[1100] = {0};
+char failsafe_value[16] = {0};
+volatile sig_atomic_t exit_request = 0;
+
+enum exit_request_type
+{
+    EXIT_STOP = 1,
+    EXIT_HANDOVER = 2,
+    EXIT_REEXEC = 3,
+};
+
+/* set across a reload, the re-executed image is already the daemon */
+#define REEXEC_ENV "FAN_CONTROL_REEXEC"
+char **main_argv;
+
+/* control state left by the previous instance, so a restart continues without a kick */
+struct handover_struct
+{
+    int valid;
+    int speed;
+    int held;
+    unsigned int curve_hash;
+    struct curve_state_struct curve;
+};
+
+char handover_file[1024] = DEFAULT_HANDOVER_PATH;
+int handover_timeout = 30;
+struct handover_struct handover;
+
+#define MAX_SENSORS 8
+
+enum sensor_type
+{
+    SENSOR_THERMAL = 0,
+    SENSOR_HWMON,
+    SENSOR_FILE,
+};
+
+/* one temperature source, the control temperature is the hottest of them after offset */
+struct sensor_struct
 {
+    int type;
+    char path[1024];
+    char name[64];
+    double scale;
+    int offset;
+    int interval_ms;
     int fd;
-    fd = open(file, O_WRONLY);
-    if (fd == -1)
-    {
-        return -1;
-    }
+    int id;
+    unsigned long long next_read_ms;
+    long long value;
+    int valid;
+};
 
-    if (write(fd, value, strnlen(value, 1024)) == -1)
-    {
-        close(fd);
-        return -1;
-    }
+struct sensor_struct sensor[MAX_SENSORS];
+int sensor_num = 0;
 
-    close(fd);
-    return 0;
-}
+struct efficiency_struct efficiency[MAX_SENSORS][MAX_TEMP_MAP_SIZE];
 
-int write_pwmchip_value(int chipId, const char *key, const char *value)
+/* every sysfs path is below sysfs_root, empty on real hardware, a fake tree for tests */
+char sysfs_root[256] = {0};
+char fan_pwm_path[512] = FAN_PWM_PATH;
+char fan_hwmon_path[512] = FAN_HWMON_PATH;
+char temp_path[512] = TEMP_PATH;
+char thermal_zone_path[512] = THERMAL_ZONE_PATH;
+char hwmon_path[512] = HWMON_PATH;
+char cpu_path[512] = CPU_PATH;
+char cpufreq_path[512] = CPUFREQ_PATH;
+
+char fan_hwmon_dir[1024] = FAN_HWMON_PATH "/hwmon8";
+char fan_tach_path[1024] = {0};
+char calibration_file[1024] = DEFAULT_CALIBRATION_PATH;
+int calibration_settle = 4;
+struct fan_calibration_struct fan_calibration;
+
+/* live state for monitoring, see status-page.h */
+char status_file[1024] = DEFAULT_STATUS_PATH;
+struct status_page *status_page = NULL;
+int fd_fan_rpm = -1;
+int id_fan_rpm = -1;
+
+/* a decision of the sampler, handed to the actuator thread */
+struct speed_decision_struct
 {
-    char file[1024];
-    snprintf(file, 1024, "%s/pwmchip%d/%s", FAN_PWM_PATH, chipId, key);
-    return write_value(file, value);
-}
+    unsigned long long timestamp_ms;
+    int temperature;
+    int speed;
+};
 
-int write_pwmchip_pwm_value(int chipId, int pwm, const char *key, const char *value)
+/*
+ * Single-producer/single-consumer ring with latest-value-wins semantics. The
+ * sampler never waits for the actuator: it overwrites the oldest slot, and the
+ * actuator only ever takes the newest decision, retrying if the producer lapped
+ * the slot while it was being copied.
+ */
+#define DECISION_CHANNEL_SIZE 4
+#define ACTUATOR_STACK_SIZE (64 * 1024)
+
+struct decision_channel_struct
 {
-    char file[1024];
-    snprintf(file, 1024, "%s/pwmchip%d/pwm%d/%s", FAN_PWM_PATH, chipId, pwm, key);
-    return write_value(file, value);
-}
+    struct speed_decision_struct slot[DECISION_CHANNEL_SIZE];
+    atomic_uint head;
+    unsigned int consumed;
+    sem_t sem;
+};
 
-int write_speed(int speed)
+int threaded = 0;
+int actuator_running = 0;
+atomic_int actuator_stop;
+pthread_t actuator_tid;
+struct decision_channel_struct decision_channel;
+atomic_ullong actuator_done_ms;
+
+/* with the actuator thread the curve is only changed, and written from, under this lock */
+pthread_mutex_t curve_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_uint curve_generation;
+/* set by the sampler when the fan was written behind the actuator's back, it forgets its last speed */
+atomic_int actuator_rewrite;
+
+/* deadline monitor: every tick must finish before the next one is due */
+int watchdog_misses = 3;
+unsigned long long deadline_misses = 0;
+int deadline_streak = 0;
+atomic_ullong loop_done_ms;
+atomic_uint watchdog_trips;
+pthread_t watchdog_tid;
+char notify_socket[108] = {0};
+int notify_fd = -1;
+unsigned long long notify_watchdog_ms = 0;
+
+#ifdef FAN_CONTROL_FIXED_MEMORY
+#define STACK_PAINT_BYTE 0xa5
+
+uintptr_t stack_paint_low = 0;
+int memory_init_done = 0;
+unsigned long malloc_after_init = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/* interpose the allocator to prove nothing allocates once the loop runs */
+void *malloc(size_t size)
 {
-    if (speed >= temp_map_size)
+    if (memory_init_done)
     {
-        return -1;
+        __atomic_fetch_add(&malloc_after_init, 1, __ATOMIC_RELAXED);
     }
+    return __libc_malloc(size);
+}
 
-    char buffer[16];
-    snprintf(buffer, 15, "%d", temp_map[speed].duty);
-    if (fan_mode == 0)
-    {
-        return write_pwmchip_pwm_value(pwmchip_id, pwmchip_gpio_id, "duty_cycle", buffer);
-    }
-    else if (fan_mode == 1)
+void *calloc(size_t nmemb, size_t size)
+{
+    if (memory_init_done)
     {
-        return write_value("/sys/devices/platform/pwm-fan/hwmon/hwmon8/pwm1", buffer);
+        __atomic_fetch_add(&malloc_after_init, 1, __ATOMIC_RELAXED);
     }
-
-    return -1;
+    return __libc_calloc(nmemb, size);
 }
 
-int set_speed(int speed)
+void *realloc(void *ptr, size_t size)
 {
-    static int last_speed = -1;
-    int ret = 0;
-    if (speed < -1 || speed >= temp_map_size)
+    if (memory_init_done)
     {
-        return 0;
+        __atomic_fetch_add(&malloc_after_init, 1, __ATOMIC_RELAXED);
     }
+    return __libc_realloc(ptr, size);
+}
+#endif
+#endif
 
-    if (last_speed == speed)
-    {
-        return 0;
-    }
+enum auto_tune_mode_type
+{
+    AUTO_TUNE_OFF = 0,
+    AUTO_TUNE_PROPOSE = 1,
+    AUTO_TUNE_APPLY = 2,
+};
 
-    if (last_speed <= 0 && speed > 0)
-    {
-        write_speed(temp_map_size - 1);
-        usleep(100000);
-    }
+/* heat input seen while the curve sat at one level */
+struct auto_tune_level_struct
+{
+    double heat;
+    unsigned long samples;
+    int duty;
+};
 
-    ret = write_speed(speed);
-    last_speed = speed;
-    return ret;
-}
+int auto_tune_mode = AUTO_TUNE_OFF;
+int auto_tune_ceiling = 75;
+int auto_tune_ambient = 25;
+int auto_tune_interval = 600;
+char auto_tune_file[1024] = DEFAULT_AUTO_TUNE_PATH;
+struct thermal_model auto_tune_model;
+struct auto_tune_level_struct auto_tune_level[MAX_TEMP_MAP_SIZE];
 
-int get_speed(int temperature)
+enum control_mode_type
 {
-    int i = 0;
-    int speed = 0;
-    static int last_speed = -1;
-    static int last_temperature = -1;
-    static int count = 0;
+    CONTROL_CURVE = 0,
+    CONTROL_MPC = 1,
+};
 
-    for (i = temp_map_size - 1; i >= 0; i--)
-    {
-        if (temperature > temp_map[i].temp)
-        {
-            speed = temp_map[i].speed;
-            if (last_speed < speed)
-            {
-                count = temp_map[i].duration;
-            }
+/* prediction steps over the horizon, the step length stretches to cover it */
+#define MPC_MAX_STEPS 30
 
-            break;
-        }
-    }
+/* model-predictive control state of the sensor */
+struct mpc_state_struct
+{
+    struct thermal_model model;
+    double heat;
+    double heat_trend;
+    double last_temp;
+    double last_duty;
+    unsigned long long last_ms;
+    int last_speed;
+    int evaluations;
+};
 
-    if (speed < last_speed)
-    {
-        count--;
-    }
-    else if (temperature > last_temperature)
-    {
-        count++;
-    }
+int control_mode = CONTROL_CURVE;
 
-    if (count <= 0 || last_speed == -1 || last_speed < speed)
-    {
-        last_speed = speed;
-    }
+enum offload_mode_type
+{
+    OFFLOAD_OFF = 0,
+    OFFLOAD_EXIT = 1,
+    OFFLOAD_IDLE = 2,
+};
 
-    last_temperature = temperature;
-    return last_speed;
-}
+#define MAX_OFFLOAD_TRIPS 16
 
-void show_help(void)
+/* hand the temp-map to the kernel thermal governor instead of running the loop */
+int offload_mode = OFFLOAD_OFF;
+char offload_governor[32] = "step_wise";
+int offload_hysteresis = 2;
+int mpc_horizon = 60;
+int mpc_ceiling = 70;
+int mpc_ambient = 25;
+int mpc_budget = 20000;
+struct mpc_state_struct mpc_state;
+
+#if defined(FAN_CONTROL_CONF_GEN) || defined(FAN_CONTROL_EMBEDDED_CONF)
+/* every scalar setting of the config file, for the generated tables */
+struct conf_int_value
 {
-    char *msg = "PI custom fan control service.\n"
-                "Usage: fan-control [option]\n"
-                "Options:\n"
-                "  -d       start as a daemon service.\n"
-                "  -p       specify a pid file path (default: /run/fan-control.pid)\n"
-                "  -s [0-6] set fan speed.\n"
-                "  -h       show help message.\n"
-                "\n";
-    printf("%s", msg);
+    int *var;
+    int value;
+};
+
+struct conf_str_value
+{
+    char *var;
+    int size;
+    const char *value;
+};
+
+#define CONF_INT_VARS(X)                                                                                                 \
+    X(pwmchip_id) X(pwmchip_gpio_id) X(pwm_period) X(throttle_detect) X(loop_interval_ms) X(use_io_uring) X(log_level)  \
+    X(log_output) X(calibration_settle) X(handover_timeout) X(threaded) X(control_mode) X(mpc_horizon) X(mpc_ceiling)     \
+    X(mpc_ambient) X(mpc_budget) X(auto_tune_mode) X(auto_tune_ceiling) X(auto_tune_ambient) X(auto_tune_interval)      \
+    X(offload_mode) X(offload_hysteresis) X(efficiency_enable) X(efficiency_ambient) X(efficiency_half_life)             \
+    X(efficiency_drift) X(efficiency_warmup) X(passive_ceiling) X(passive_hysteresis) X(passive_step) X(passive_floor)   \
+    X(failsafe_temp_min) X(failsafe_temp_max) X(failsafe_retries) X(failsafe_safe_duty) X(failsafe_write_faults)         \
+    X(watchdog_misses) X(dither_enable) X(dither_interval) X(lease_enable) X(lease_max)   \
+    X(lease_max_duration)
+
+#define CONF_STR_VARS(X)                                                                                                 \
+    X(log_file) X(fan_tach_path) X(calibration_file) X(handover_file) X(status_file) X(auto_tune_file)                  \
+    X(efficiency_file) X(offload_governor) X(lease_socket)
+#endif
+
+#ifdef FAN_CONTROL_EMBEDDED_CONF
+#include "embedded-conf.h"
+#endif
+
+unsigned long long get_monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int init_pwm_gpio_by_ids(int chipId, int pwmId)
+unsigned long long get_monotonic_ns(void)
 {
-    int ret = 0;
-    char max_speed[16];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    snprintf(max_speed, 15, "%d", temp_map[temp_map_size - 1].duty);
-    ret = write_pwmchip_value(chipId, "export", "0");
-    if (ret < 0 && errno != EBUSY)
+int read_fd_value(int fd, long long *value)
+{
+    char buff[TMP_BUFF_LEN_32];
+    int len = pread(fd, buff, sizeof(buff) - 1, 0);
+    if (len <= 0)
     {
-        printf("Failed to export GPIO, %s\n", strerror(errno));
         return -1;
     }
 
-    ret = write_pwmchip_pwm_value(chipId, pwmId, "duty_cycle", "0");
-    if (ret < 0 && errno != EINVAL)
-    {
-        printf("Failed to export GPIO, %s\n", strerror(errno));
-        goto do_unexport;
-    }
+    buff[len] = '\0';
+    *value = atoll(buff);
+    return 0;
+}
 
-    ret = write_pwmchip_pwm_value(chipId, pwmId, "period", max_speed);
-    if (ret < 0)
+#ifdef FAN_CONTROL_FIXED_MEMORY
+/* fill the stack below main() with a pattern, stack_high_water() looks for the deepest overwrite */
+void __attribute__((noinline)) stack_paint(void)
+{
+    volatile unsigned char buff[STACK_PAINT_SIZE];
+    for (int i = 0; i < STACK_PAINT_SIZE; i++)
     {
-        printf("Failed to export GPIO, %s\n", strerror(errno));
-        goto do_unexport;
+        buff[i] = STACK_PAINT_BYTE;
     }
+    stack_paint_low = (uintptr_t)buff;
+}
 
-    ret = write_pwmchip_pwm_value(chipId, pwmId, "polarity", "normal");
-    if (ret < 0)
-    {
-        printf("Failed to export GPIO, %s\n", strerror(errno));
-        goto do_unexport;
-    }
+size_t stack_high_water(void)
+{
+    const volatile unsigned char *buff = (const volatile unsigned char *)stack_paint_low;
+    size_t i = 0;
 
-    ret = write_pwmchip_pwm_value(chipId, pwmId, "enable", "1");
-    if (ret < 0)
+    while (i < STACK_PAINT_SIZE && buff[i] == STACK_PAINT_BYTE)
     {
-        printf("Failed to export GPIO, %s\n", strerror(errno));
-        goto do_unexport;
+        i++;
     }
 
-    return 0;
-
-do_unexport:
-    write_pwmchip_value(chipId, "unexport", "0");
-    return -1;
+    return STACK_PAINT_SIZE - i;
 }
+#endif
 
-int init_pwm_GPIO()
+long read_proc_status_kb(const char *status, const char *key)
 {
-    if (pwmchip_id > 0)
+    const char *p = strstr(status, key);
+    if (p == NULL)
     {
-        if (init_pwm_gpio_by_ids(pwmchip_id, pwmchip_gpio_id) != 0)
-        {
-            printf("Failed to init pwmchip%d GPIO %d, %s\n", pwmchip_id, pwmchip_gpio_id, strerror(errno));
-            return -1;
-        }
+        return -1;
     }
 
-    for (int i = 0; i < 6; i++)
+    return atol(p + strlen(key));
+}
+
+void show_memory_usage(void)
+{
+    char status[4096] = {0};
+    int fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
     {
-        if (init_pwm_gpio_by_ids(i, pwmchip_gpio_id) == 0)
+        if (read(fd, status, sizeof(status) - 1) < 0)
         {
-            pwmchip_id = i;
-            printf("Found pwmchip%d\n", pwmchip_id);
-            fan_mode = 0;
-            return 0;
+            status[0] = '\0';
         }
+        close(fd);
     }
 
-    printf("Failed to init GPIO\n");
-    return -1;
+    tlog(TLOG_NOTICE, "memory: peak rss %ld kB, rss %ld kB, locked %ld kB", read_proc_status_kb(status, "VmHWM:"),
+         read_proc_status_kb(status, "VmRSS:"), read_proc_status_kb(status, "VmLck:"));
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    tlog(TLOG_NOTICE, "memory: heap in use %zu bytes, heap arena %zu bytes", mi.uordblks, mi.arena);
+#endif
+#ifdef FAN_CONTROL_FIXED_MEMORY
+    tlog(TLOG_NOTICE, "memory: stack high-water %zu bytes, allocations after init %lu", stack_high_water(), malloc_after_init);
+#endif
 }
 
-int init_thermal()
+void sig_show_memory(int sig)
 {
-    int ret = write_value("/sys/class/thermal/thermal_zone0/policy", "user_space");
-    if (ret < 0)
+    show_memory_request = 1;
+}
+
+int write_value(const char *file, const char *value)
+{
+    int fd;
+    fd = open(file, O_WRONLY);
+    if (fd == -1)
     {
-        printf("Failed to set thermal policy, %s\n", strerror(errno));
         return -1;
     }
 
-    ret = write_value("/sys/class/thermal/thermal_zone0/mode", "disabled");
-    if (ret < 0)
+    if (write(fd, value, strnlen(value, 1024)) == -1)
     {
-        printf("Failed to set thermal mode, %s\n", strerror(errno));
+        close(fd);
         return -1;
     }
 
-    fan_mode = 1;
-
+    close(fd);
     return 0;
 }
 
-void update_temp_map()
+/* read a one-line sysfs attribute, without the trailing newline */
+int read_string(const char *file, char *buff, int size)
 {
-    for (int i = 0; i < temp_map_size; i++)
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int len = read(fd, buff, size - 1);
+    close(fd);
+    if (len <= 0)
     {
-        temp_map[i].duty = temp_map[i].duty * 100 / pwm_period * 255 / 100;
+        return -1;
     }
+
+    buff[len] = '\0';
+    buff[strcspn(buff, "\n")] = '\0';
+    return 0;
 }
 
-int create_pid_file(const char *pid_file)
+int write_thermal_zone_value(const char *key, const char *value)
 {
-    int fd = 0;
+    char file[1024];
+    snprintf(file, sizeof(file), "%s/thermal_zone0/%s", thermal_zone_path, key);
+    return write_value(file, value);
+}
+
+void init_sysfs_paths(const char *root)
+{
+    strncpy(sysfs_root, root, sizeof(sysfs_root) - 1);
+    snprintf(fan_pwm_path, sizeof(fan_pwm_path), "%s%s", sysfs_root, FAN_PWM_PATH);
+    snprintf(fan_hwmon_path, sizeof(fan_hwmon_path), "%s%s", sysfs_root, FAN_HWMON_PATH);
+    snprintf(temp_path, sizeof(temp_path), "%s%s", sysfs_root, TEMP_PATH);
+    snprintf(thermal_zone_path, sizeof(thermal_zone_path), "%s%s", sysfs_root, THERMAL_ZONE_PATH);
+    snprintf(hwmon_path, sizeof(hwmon_path), "%s%s", sysfs_root, HWMON_PATH);
+    snprintf(cpu_path, sizeof(cpu_path), "%s%s", sysfs_root, CPU_PATH);
+    snprintf(cpufreq_path, sizeof(cpufreq_path), "%s%s", sysfs_root, CPUFREQ_PATH);
+    snprintf(fan_hwmon_dir, sizeof(fan_hwmon_dir), "%s/hwmon8", fan_hwmon_path);
+}
+
+int write_pwmchip_value(int chipId, const char *key, const char *value)
+{
+    char file[1024];
+    snprintf(file, 1024, "%s/pwmchip%d/%s", fan_pwm_path, chipId, key);
+    return write_value(file, value);
+}
+
+int write_pwmchip_pwm_value(int chipId, int pwm, const char *key, const char *value)
+{
+    char file[1024];
+    snprintf(file, 1024, "%s/pwmchip%d/pwm%d/%s", fan_pwm_path, chipId, pwm, key);
+    return write_value(file, value);
+}
+
+int duty_full_scale(void)
+{
+    return fan_mode == 1 ? 255 : pwm_period;
+}
+
+/* hardware duty, in percent, at which the calibrated fan reaches percent of its maximum speed */
+double calibrated_duty(int percent)
+{
+    struct fan_calibration_struct *cal = &fan_calibration;
+    double rpm = (double)percent * cal->max_rpm / 100;
+    int i = 0;
+
+    for (i = 1; i < cal->count; i++)
+    {
+        if (cal->rpm[i] >= rpm)
+        {
+            break;
+        }
+    }
+
+    if (i >= cal->count)
+    {
+        return cal->duty[cal->count - 1];
+    }
+
+    double span = cal->rpm[i] - cal->rpm[i - 1];
+    double duty = cal->duty[i - 1];
+    if (span > 0)
+    {
+        duty += (rpm - cal->rpm[i - 1]) * (cal->duty[i] - cal->duty[i - 1]) / span;
+    }
+
+    /* below the stall duty the fan would just stop */
+    if (duty < cal->stall_duty)
+    {
+        duty = cal->stall_duty;
+    }
+
+    return duty;
+}
+
+int duty_from_percent(int percent)
+{
+    if (percent <= 0)
+    {
+        return 0;
+    }
+
+    if (fan_calibration.valid)
+    {
+        return (int)(calibrated_duty(percent) * duty_full_scale() / 100 + 0.5);
+    }
+
+    return percent * duty_full_scale() / 100;
+}
+
+/* the duty the fan should get, before rounding to the controller's resolution */
+double exact_duty_from_percent(int percent)
+{
+    if (percent <= 0)
+    {
+        return 0;
+    }
+
+    if (fan_calibration.valid)
+    {
+        return calibrated_duty(percent) * duty_full_scale() / 100;
+    }
+
+    return (double)percent * duty_full_scale() / 100;
+}
+
+int fan_duty_path(char *file, int size)
+{
+    if (fan_mode == 0)
+    {
+        snprintf(file, size, "%s/pwmchip%d/pwm%d/duty_cycle", fan_pwm_path, pwmchip_id, pwmchip_gpio_id);
+        return 0;
+    }
+    else if (fan_mode == 1)
+    {
+        snprintf(file, size, "%s/pwm1", fan_hwmon_dir);
+        return 0;
+    }
+
+    return -1;
+}
+
+int write_duty(int duty)
+{
+    char buffer[16];
+    char file[1100];
+
+    if (fan_duty_path(file, sizeof(file)) != 0)
+    {
+        return -1;
+    }
+
+    snprintf(buffer, 15, "%d", duty);
+    int ret = write_value(file, buffer);
+    TRACE_PROBE3(actuate, file, duty, ret == 0 ? 0 : errno);
+    return ret;
+}
+
+int dither_active(void)
+{
+    return dither_enable && fan_mode == 1;
+}
+
+/*
+ * First-order sigma-delta: each step writes the count nearest to the target
+ * plus the error carried from the previous steps, so the average duty over a
+ * few steps matches the target. Steps are taken on the tick nearest to each
+ * dither-interval, so tick jitter does not skip every other one, and only a
+ * changed count is written.
+ */
+int dither_write(int speed, int restart)
+{
+    unsigned long long now = get_monotonic_ms();
+
+    if (restart)
+    {
+        dither_error = 0;
+        dither_written = -1;
+    }
+    else if (now - dither_last_ms + loop_interval_ms / 2 < (unsigned long long)dither_interval)
+    {
+        return 0;
+    }
+
+    double want = exact_duty_from_percent(temp_map[speed].percent) + dither_error;
+    int duty = (int)(want + 0.5);
+    duty = duty < 0 ? 0 : duty > duty_full_scale() ? duty_full_scale() : duty;
+    dither_error = want - duty;
+    dither_last_ms = now;
+    if (duty == dither_written)
+    {
+        return 0;
+    }
+
+    int ret = write_duty(duty);
+    dither_written = ret == 0 ? duty : -1;
+    return ret;
+}
+
+int write_speed(int speed)
+{
+    if (speed >= temp_map_size)
+    {
+        return -1;
+    }
+
+    if (dither_active())
+    {
+        return dither_write(speed, 1);
+    }
+
+    return write_duty(temp_map[speed].duty);
+}
+
+int set_speed_last = -1;
+
+/* a fan at standstill needs a kick, unless the calibration shows it starts at this duty by itself */
+int kick_needed(int speed)
+{
+    if (!fan_calibration.valid || fan_calibration.start_duty <= 0)
+    {
+        return 1;
+    }
+
+    return temp_map[speed].duty * 100 < fan_calibration.start_duty * duty_full_scale();
+}
+
+int set_speed(int speed)
+{
+    int ret = 0;
+    if (speed < -1 || speed >= temp_map_size)
+    {
+        return 0;
+    }
+
+    if (set_speed_last == speed)
+    {
+        return dither_active() ? dither_write(speed, 0) : 0;
+    }
+
+    if (set_speed_last <= 0 && speed > 0 && kick_needed(speed))
+    {
+        write_speed(temp_map_size - 1);
+        usleep(100000);
+    }
+
+    /* keep the old speed on failure, so the write is retried next time */
+    ret = write_speed(speed);
+    if (ret != 0)
+    {
+        if (atomic_fetch_add(&actuator_failures, 1) + 1 >= failsafe_write_faults)
+        {
+            atomic_fetch_or(&fault_flags, FAULT_ACTUATOR);
+        }
+        return ret;
+    }
+
+    if (atomic_exchange(&actuator_failures, 0) >= failsafe_write_faults)
+    {
+        tlog(TLOG_NOTICE, "Fan writes recovered.");
+    }
+    atomic_fetch_and(&fault_flags, ~FAULT_ACTUATOR);
+    set_speed_last = speed;
+    return ret;
+}
+
+/* precompute what the fatal signal handler writes, it cannot format anything itself */
+void failsafe_prepare()
+{
+    snprintf(failsafe_value, sizeof(failsafe_value), "%d", duty_from_percent(failsafe_safe_duty));
+    if (fan_duty_path(failsafe_file, sizeof(failsafe_file)) != 0)
+    {
+        failsafe_file[0] = '\0';
+    }
+}
+
+int failsafe_write()
+{
+    if (failsafe_file[0] == '\0')
+    {
+        return -1;
+    }
+
+    return write_value(failsafe_file, failsafe_value);
+}
+
+/* the last write on a stop, read back so a lost or overwritten safe duty is retried */
+int failsafe_write_verified()
+{
+    char buff[16];
+
+    for (int i = 0; i <= failsafe_retries; i++)
+    {
+        if (failsafe_write() == 0 && read_string(failsafe_file, buff, sizeof(buff)) == 0 && strcmp(buff, failsafe_value) == 0)
+        {
+            return 0;
+        }
+        usleep(100000);
+    }
+
+    return -1;
+}
+
+void sig_exit(int sig)
+{
+    /* the service manager follows a restart's SIGUSR2 with SIGTERM, it must not turn into a stop */
+    if (exit_request == EXIT_HANDOVER || exit_request == EXIT_REEXEC)
+    {
+        return;
+    }
+
+    exit_request = sig == SIGUSR2 ? EXIT_HANDOVER : sig == SIGHUP ? EXIT_REEXEC : EXIT_STOP;
+}
+
+/* reload: replace the image in place, the pid stays and the new binary picks up the handover state */
+void reexec()
+{
+    const char *path = strchr(main_argv[0], '/') != NULL ? main_argv[0] : "/proc/self/exe";
+
+    tlog(TLOG_NOTICE, "Reload, re-execute %s at speed %d.", path, set_speed_last);
+    sysfs_read_exit();
+    tlog_exit();
+    setenv(REEXEC_ENV, "1", 1);
+    execv(path, main_argv);
+
+    unsetenv(REEXEC_ENV);
+    tlog(TLOG_ERROR, "Failed to re-execute %s, %s, exit for handover.", path, strerror(errno));
+}
+
+/* give back the frequency taken by passive cooling, also called from the fatal signal handler */
+void passive_restore()
+{
+    for (int i = 0; i < cpufreq_policy_num; i++)
+    {
+        struct cpufreq_policy_struct *policy = &cpufreq_policy[i];
+        if (policy->cap > 0)
+        {
+            write_value(policy->max_path, policy->restore_value);
+            policy->cap = 0;
+        }
+    }
+
+    passive_level = 0;
+}
+
+void sig_fatal(int sig)
+{
+    failsafe_write();
+    passive_restore();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+int failsafe_temperature_plausible(long long value)
+{
+    return value > (long long)failsafe_temp_min * 1000 && value <= (long long)failsafe_temp_max * 1000;
+}
+
+int failsafe_read_sensor(int fd, long long *value)
+{
+    if (read_fd_value(fd, value) != 0)
+    {
+        return -1;
+    }
+
+    if (!failsafe_temperature_plausible(*value))
+    {
+        atomic_fetch_or(&fault_flags, FAULT_SENSOR_IMPLAUSIBLE);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read one sensor, in millidegrees after scaling. A failed or implausible
+ * reading is retried with exponential backoff.
+ */
+int sensor_read(struct sensor_struct *sensor, long long *value)
+{
+    unsigned long long read_start = TRACE_ENABLED(sensor_read) ? get_monotonic_ns() : 0;
+    int delay_us = 10000;
+    int ok = 0;
+    long long raw = -1;
+
+    for (int i = 0; i <= failsafe_retries && !ok; i++)
+    {
+        if (i > 0)
+        {
+            usleep(delay_us);
+            delay_us *= 2;
+        }
+
+        /* the first try takes the value of this tick's batch, if the sensor is in it */
+        int ret = (i == 0 && sensor->id >= 0) ? sysfs_read_value(sensor->id, &raw) : read_fd_value(sensor->fd, &raw);
+        if (ret != 0)
+        {
+            continue;
+        }
+
+        *value = (long long)(raw * sensor->scale);
+        ok = failsafe_temperature_plausible(*value);
+        if (!ok)
+        {
+            atomic_fetch_or(&fault_flags, FAULT_SENSOR_IMPLAUSIBLE);
+        }
+    }
+
+    if (TRACE_ENABLED(sensor_read))
+    {
+        TRACE_PROBE3(sensor_read, sensor->path, ok ? *value : -1, get_monotonic_ns() - read_start);
+    }
+
+    if (!ok)
+    {
+        tlog_ratelimit(TLOG_ERROR, "Failed to read a plausible temperature from %s, last value %lld.", sensor->path, raw);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read the control temperature: the hottest of the sensors after their
+ * offset. Slow sources keep their last value until their interval has
+ * passed. If none of them gives a usable value the fallback sensors are
+ * tried in order. Returns -1 only if no sensor gave a usable value.
+ */
+int read_temperature(long long *value)
+{
+    unsigned long long now = get_monotonic_ms();
+    int faulted = 0;
+    int found = 0;
+
+    for (int i = 0; i < sensor_num; i++)
+    {
+        struct sensor_struct *s = &sensor[i];
+        if (s->fd < 0)
+        {
+            faulted = 1;
+            continue;
+        }
+
+        if (s->id < 0 && s->valid && now < s->next_read_ms)
+        {
+            /* slow source, not due yet */
+        }
+        else
+        {
+            s->next_read_ms = now + s->interval_ms;
+            s->valid = sensor_read(s, &s->value) == 0;
+        }
+
+        if (!s->valid)
+        {
+            faulted = 1;
+            continue;
+        }
+
+        long long temperature = s->value + (long long)s->offset * 1000;
+        if (!found || temperature > *value)
+        {
+            *value = temperature;
+        }
+        found = 1;
+    }
+
+    if (found)
+    {
+        atomic_fetch_and(&fault_flags, ~(FAULT_SENSOR_IMPLAUSIBLE | FAULT_SENSOR_LOST));
+        if (faulted)
+        {
+            atomic_fetch_or(&fault_flags, FAULT_SENSOR);
+        }
+        else
+        {
+            atomic_fetch_and(&fault_flags, ~FAULT_SENSOR);
+        }
+        return 0;
+    }
+
+    atomic_fetch_or(&fault_flags, FAULT_SENSOR);
+    for (int i = 0; i < fallback_sensor_num; i++)
+    {
+        if (fallback_sensor_fd[i] >= 0 && failsafe_read_sensor(fallback_sensor_fd[i], value) == 0)
+        {
+            atomic_fetch_and(&fault_flags, ~FAULT_SENSOR_LOST);
+            return 0;
+        }
+    }
+
+    atomic_fetch_or(&fault_flags, FAULT_SENSOR_LOST);
+    return -1;
+}
+
+/* hwmon devices are numbered in probe order, find the one by its driver name */
+int find_hwmon_by_name(const char *name, char *dir_path, int size)
+{
+    DIR *dir = opendir(hwmon_path);
+    struct dirent *ent = NULL;
+    char file[1100];
+    char buff[64];
+
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strncmp(ent->d_name, "hwmon", 5) != 0)
+        {
+            continue;
+        }
+
+        snprintf(file, sizeof(file), "%s/%s/name", hwmon_path, ent->d_name);
+        if (read_string(file, buff, sizeof(buff)) != 0)
+        {
+            continue;
+        }
+
+        if (strcmp(buff, name) == 0)
+        {
+            snprintf(dir_path, size, "%s/%s", hwmon_path, ent->d_name);
+            closedir(dir);
+            return 0;
+        }
+    }
+
+    closedir(dir);
+    return -1;
+}
+
+int init_sensors()
+{
+    if (sensor_num == 0)
+    {
+        memset(&sensor[0], 0, sizeof(sensor[0]));
+        sensor[0].type = SENSOR_THERMAL;
+        sensor[0].scale = 1;
+        strncpy(sensor[0].path, temp_path, sizeof(sensor[0].path) - 1);
+        sensor_num = 1;
+    }
+
+    for (int i = 0; i < sensor_num; i++)
+    {
+        struct sensor_struct *s = &sensor[i];
+        s->id = -1;
+        s->fd = open(s->path, O_RDONLY | O_CLOEXEC);
+        if (s->fd < 0)
+        {
+            tlog(TLOG_ERROR, "Failed to open temperature file %s, %s", s->path, strerror(errno));
+            if (sensor_num == 1)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        /* sources read every tick go into the batch, slow ones are read when due */
+        if (s->interval_ms <= loop_interval_ms)
+        {
+            s->interval_ms = 0;
+            s->id = sysfs_read_register(s->fd);
+        }
+    }
+
+    return 0;
+}
+
+void close_sensors()
+{
+    for (int i = 0; i < sensor_num; i++)
+    {
+        if (sensor[i].fd >= 0)
+        {
+            close(sensor[i].fd);
+            sensor[i].fd = -1;
+        }
+    }
+}
+
+int init_fallback_sensors()
+{
+    for (int i = 0; i < fallback_sensor_num; i++)
+    {
+        fallback_sensor_fd[i] = open(fallback_sensor_path[i], O_RDONLY | O_CLOEXEC);
+        if (fallback_sensor_fd[i] < 0)
+        {
+            tlog(TLOG_WARN, "Failed to open fallback sensor %s, %s", fallback_sensor_path[i], strerror(errno));
+        }
+    }
+
+    return 0;
+}
+
+void decision_publish(const struct speed_decision_struct *decision)
+{
+    unsigned int head = atomic_load_explicit(&decision_channel.head, memory_order_relaxed);
+    decision_channel.slot[head % DECISION_CHANNEL_SIZE] = *decision;
+    atomic_store_explicit(&decision_channel.head, head + 1, memory_order_release);
+    sem_post(&decision_channel.sem);
+}
+
+int decision_take_latest(struct speed_decision_struct *decision)
+{
+    for (;;)
+    {
+        unsigned int head = atomic_load_explicit(&decision_channel.head, memory_order_acquire);
+        if (head == decision_channel.consumed)
+        {
+            return -1;
+        }
+
+        *decision = decision_channel.slot[(head - 1) % DECISION_CHANNEL_SIZE];
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&decision_channel.head, memory_order_relaxed) - (head - 1) < DECISION_CHANNEL_SIZE)
+        {
+            decision_channel.consumed = head;
+            return 0;
+        }
+    }
+}
+
+void *actuator_worker(void *arg)
+{
+    struct speed_decision_struct decision;
+    unsigned int curve_seen = atomic_load(&curve_generation);
+    int pending = 0;
+    int backoff_ms = 100;
+
+    while (!atomic_load(&actuator_stop))
+    {
+        if (pending)
+        {
+            /* retry a failed write with backoff, unless a new decision arrives first */
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += backoff_ms / 1000;
+            ts.tv_nsec += (long)(backoff_ms % 1000) * 1000000;
+            ts.tv_sec += ts.tv_nsec / 1000000000;
+            ts.tv_nsec %= 1000000000;
+            sem_timedwait(&decision_channel.sem, &ts);
+        }
+        else if (sem_wait(&decision_channel.sem) != 0)
+        {
+            continue;
+        }
+
+        if (atomic_load(&actuator_stop))
+        {
+            break;
+        }
+
+        /* older decisions queued behind the semaphore are simply skipped */
+        if (decision_take_latest(&decision) != 0 && !pending)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&curve_lock);
+        unsigned int generation = atomic_load(&curve_generation);
+        if (generation != curve_seen && set_speed_last == decision.speed)
+        {
+            /* the sampler retuned the curve, the level already written has a new duty */
+            write_speed(decision.speed);
+        }
+        curve_seen = generation;
+        if (atomic_exchange(&actuator_rewrite, 0))
+        {
+            set_speed_last = temp_map_size;
+        }
+        int ret = set_speed(decision.speed);
+        pthread_mutex_unlock(&curve_lock);
+
+        if (ret != 0)
+        {
+            tlog_ratelimit(TLOG_ERROR, "Failed to set speed %d, %s", decision.speed, strerror(errno));
+            pending = 1;
+            backoff_ms = backoff_ms * 2 > 5000 ? 5000 : backoff_ms * 2;
+            continue;
+        }
+
+        pending = 0;
+        backoff_ms = 100;
+        atomic_store(&actuator_done_ms, decision.timestamp_ms);
+
+        unsigned long long latency = get_monotonic_ms() - decision.timestamp_ms;
+        if (latency > 1000)
+        {
+            tlog_ratelimit(TLOG_WARN, "Fan write lagged %llu ms behind the decision.", latency);
+        }
+    }
+
+    return NULL;
+}
+
+int start_actuator()
+{
+    pthread_attr_t attr;
+    size_t stack_size = ACTUATOR_STACK_SIZE;
+
+    memset(&decision_channel, 0, sizeof(decision_channel));
+    if (sem_init(&decision_channel.sem, 0, 0) != 0)
+    {
+        return -1;
+    }
+
+    if (stack_size < PTHREAD_STACK_MIN)
+    {
+        stack_size = PTHREAD_STACK_MIN;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    if (pthread_create(&actuator_tid, &attr, actuator_worker, NULL) != 0)
+    {
+        pthread_attr_destroy(&attr);
+        sem_destroy(&decision_channel.sem);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    actuator_running = 1;
+    return 0;
+}
+
+/* wait for the write in flight, nothing may reach the fan after the exit path's own writes */
+void stop_actuator()
+{
+    if (!actuator_running)
+    {
+        return;
+    }
+
+    atomic_store(&actuator_stop, 1);
+    sem_post(&decision_channel.sem);
+    pthread_join(actuator_tid, NULL);
+    sem_destroy(&decision_channel.sem);
+    actuator_running = 0;
+}
+
+/* the service manager's watchdog, set up before daemon() changes the pid it was meant for */
+void notify_init()
+{
+    const char *socket_path = getenv("NOTIFY_SOCKET");
+    const char *usec = getenv("WATCHDOG_USEC");
+    const char *pid = getenv("WATCHDOG_PID");
+
+    if (socket_path == NULL || usec == NULL || (socket_path[0] != '/' && socket_path[0] != '@'))
+    {
+        return;
+    }
+
+    if (pid != NULL && atoi(pid) != getpid())
+    {
+        return;
+    }
+
+    strncpy(notify_socket, socket_path, sizeof(notify_socket) - 1);
+    notify_watchdog_ms = strtoull(usec, NULL, 10) / 1000;
+}
+
+/* sd_notify() without libsystemd */
+int notify_send(const char *msg)
+{
+    struct sockaddr_un addr;
+
+    if (notify_socket[0] == '\0')
+    {
+        return -1;
+    }
+
+    if (notify_fd < 0)
+    {
+        notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (notify_fd < 0)
+        {
+            return -1;
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, notify_socket, strlen(notify_socket));
+    socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(notify_socket);
+    if (addr.sun_path[0] == '@')
+    {
+        /* abstract namespace */
+        addr.sun_path[0] = '\0';
+    }
+
+    return sendto(notify_fd, msg, strlen(msg), MSG_NOSIGNAL, (struct sockaddr *)&addr, len) < 0 ? -1 : 0;
+}
+
+/* force the safe duty when the control loop has not completed a tick for watchdog-misses intervals */
+void *watchdog_worker(void *arg)
+{
+    struct timespec ts = {loop_interval_ms / 1000, (long)(loop_interval_ms % 1000) * 1000000};
+    unsigned long long limit = (unsigned long long)(watchdog_misses + 1) * loop_interval_ms;
+
+    while (1)
+    {
+        nanosleep(&ts, NULL);
+        unsigned long long stalled = get_monotonic_ms() - atomic_load(&loop_done_ms);
+        if (stalled <= limit || (atomic_load(&fault_flags) & FAULT_LOOP_STALL))
+        {
+            continue;
+        }
+
+        atomic_fetch_or(&fault_flags, FAULT_LOOP_STALL);
+        atomic_fetch_add(&watchdog_trips, 1);
+        int ret = failsafe_write();
+        tlog(TLOG_ERROR, "Control loop stalled for %llu ms, %s safe duty %d%%.", stalled, ret == 0 ? "set" : "failed to set",
+             failsafe_safe_duty);
+    }
+
+    return NULL;
+}
+
+int start_watchdog()
+{
+    pthread_attr_t attr;
+    size_t stack_size = ACTUATOR_STACK_SIZE;
+
+    if (watchdog_misses <= 0)
+    {
+        return 0;
+    }
+
+    if (stack_size < PTHREAD_STACK_MIN)
+    {
+        stack_size = PTHREAD_STACK_MIN;
+    }
+
+    atomic_store(&loop_done_ms, get_monotonic_ms());
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    int ret = pthread_create(&watchdog_tid, &attr, watchdog_worker, NULL);
+    pthread_attr_destroy(&attr);
+    return ret == 0 ? 0 : -1;
+}
+
+/* account the tick that started at tick_ms; ping the service manager only after a complete, timely tick */
+void deadline_check(unsigned long long tick_ms, unsigned long long published_ms, int actuated)
+{
+    static unsigned long long last_notify_ms = 0;
+    unsigned long long now = get_monotonic_ms();
+
+    atomic_store(&loop_done_ms, now);
+    if (actuator_running)
+    {
+        /* a decision still in flight within its tick counts as actuated */
+        actuated = atomic_load(&actuator_done_ms) >= published_ms || now - published_ms < (unsigned long long)loop_interval_ms;
+    }
+
+    if (now > tick_ms + loop_interval_ms)
+    {
+        deadline_misses++;
+        deadline_streak++;
+        tlog_ratelimit(TLOG_WARN, "Tick took %llu ms, deadline %d ms missed, %llu in total.", now - tick_ms, loop_interval_ms,
+                       deadline_misses);
+        return;
+    }
+
+    deadline_streak = 0;
+    /* ping now if waiting for the next tick would leave less than half the watchdog timeout */
+    if (actuated && notify_watchdog_ms > 0 && now - last_notify_ms + loop_interval_ms > notify_watchdog_ms / 2)
+    {
+        notify_send("WATCHDOG=1");
+        last_notify_ms = now;
+    }
+}
+
+/* temp-map durations are in seconds, the hysteresis counter runs once per tick */
+int duration_ticks(int duration)
+{
+    return (duration * 1000 + loop_interval_ms - 1) / loop_interval_ms;
+}
+
+int curve_get_speed(struct curve_state_struct *state, struct temp_map_struct *map, int map_size, int temperature,
+                    int throttled)
+{
+    int i = 0;
+    int speed = 0;
+
+    for (i = map_size - 1; i >= 0; i--)
+    {
+        if (temperature > map[i].temp)
+        {
+            speed = map[i].speed;
+            if (state->last_speed < speed)
+            {
+                state->count = duration_ticks(map[i].duration);
+            }
+
+            break;
+        }
+    }
+
+    /* the chip is already losing frequency, step up at once regardless of hysteresis */
+    if (throttled && speed <= state->last_speed && state->last_speed < map_size - 1)
+    {
+        speed = state->last_speed + 1;
+        state->count = duration_ticks(map[speed].duration);
+    }
+
+    if (speed < state->last_speed)
+    {
+        state->count--;
+    }
+    else if (temperature > state->last_temperature)
+    {
+        state->count++;
+    }
+
+    if (state->count <= 0 || state->last_speed == -1 || state->last_speed < speed)
+    {
+        state->last_speed = speed;
+    }
+
+    state->last_temperature = temperature;
+    return state->last_speed;
+}
+
+int get_speed(int temperature, int throttled)
+{
+    int old_speed = active_curve_state.last_speed;
+    int speed = curve_get_speed(&active_curve_state, temp_map, temp_map_size, temperature, throttled);
+
+    TRACE_PROBE3(decision, old_speed, speed, active_curve_state.count);
+    return speed;
+}
+
+void curve_stats_update(struct curve_stats_struct *stats, int speed, int percent)
+{
+    if (stats->last_speed >= 0 && stats->last_speed != speed)
+    {
+        stats->actuations++;
+    }
+
+    stats->last_speed = speed;
+    stats->duty_seconds += percent / 100.0 * loop_interval_ms / 1000.0;
+    for (int i = 0; i < CURVE_STATS_THRESHOLDS; i++)
+    {
+        if (percent >= curve_stats_threshold[i])
+        {
+            stats->above_ms[i] += loop_interval_ms;
+        }
+    }
+}
+
+void curve_stats_show(const char *name, struct curve_stats_struct *stats)
+{
+    tlog(TLOG_NOTICE, "curve %s: duty-seconds %.1f, actuations %lu, duty >=%d%% %llus, >=%d%% %llus, >=%d%% %llus, >=%d%% %llus",
+         name, stats->duty_seconds, stats->actuations, curve_stats_threshold[0], stats->above_ms[0] / 1000,
+         curve_stats_threshold[1], stats->above_ms[1] / 1000, curve_stats_threshold[2], stats->above_ms[2] / 1000,
+         curve_stats_threshold[3], stats->above_ms[3] / 1000);
+}
+
+/* run the shadow curves on the sample the active controller just used, sensor_ok 0 means it was lost */
+void shadow_update(int temperature, int throttled, int sensor_ok)
+{
+    for (int i = 0; i < shadow_curve_num; i++)
+    {
+        struct shadow_curve_struct *shadow = &shadow_curve[i];
+        int speed = shadow->map_size - 1;
+        if (sensor_ok)
+        {
+            speed = curve_get_speed(&shadow->state, shadow->map, shadow->map_size, temperature, throttled);
+        }
+
+        curve_stats_update(&shadow->stats, speed, shadow->map[speed].percent);
+    }
+}
+
+void shadow_show()
+{
+    if (shadow_curve_num == 0)
+    {
+        return;
+    }
+
+    curve_stats_show("active", &active_curve_stats);
+    for (int i = 0; i < shadow_curve_num; i++)
+    {
+        curve_stats_show(shadow_curve[i].name, &shadow_curve[i].stats);
+    }
+}
+
+/* cgroup.events is modified whenever populated flips, its parent sees the cgroup come and go */
+void profile_refresh(struct profile_struct *p)
+{
+    char file[1100];
+    char buff[128];
+
+    snprintf(file, sizeof(file), "%s/cgroup.events", p->cgroup);
+    if (p->wd_events < 0)
+    {
+        p->wd_events = inotify_add_watch(profile_inotify_fd, file, IN_MODIFY);
+    }
+
+    p->populated = 0;
+    if (read_string(file, buff, sizeof(buff)) == 0)
+    {
+        /* read_string keeps the first line only, populated always comes first */
+        p->populated = strcmp(buff, "populated 1") == 0;
+    }
+    else
+    {
+        p->wd_events = -1;
+    }
+}
+
+int profile_init()
+{
+    char dir[512];
+
+    if (profile_num == 0)
+    {
+        return 0;
+    }
+
+    profile_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (profile_inotify_fd < 0)
+    {
+        tlog(TLOG_ERROR, "Failed to init inotify, %s", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < profile_num; i++)
+    {
+        struct profile_struct *p = &profile[i];
+        strncpy(dir, p->cgroup, sizeof(dir) - 1);
+        p->wd_parent = inotify_add_watch(profile_inotify_fd, dirname(dir), IN_CREATE | IN_DELETE | IN_ONLYDIR);
+        if (p->wd_parent < 0)
+        {
+            tlog(TLOG_WARN, "Failed to watch cgroup %s of profile %s, %s", p->cgroup, p->name, strerror(errno));
+        }
+
+        p->wd_events = -1;
+        profile_refresh(p);
+    }
+
+    return 0;
+}
+
+/* drain the inotify events and re-read the cgroups they point at */
+void profile_events()
+{
+    char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int len = 0;
+
+    while ((len = read(profile_inotify_fd, buff, sizeof(buff))) > 0)
+    {
+        for (char *ptr = buff; ptr < buff + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            for (int i = 0; i < profile_num; i++)
+            {
+                if (event->wd == profile[i].wd_events || event->wd == profile[i].wd_parent)
+                {
+                    if (event->mask & IN_IGNORED)
+                    {
+                        profile[i].wd_events = -1;
+                    }
+                    profile_refresh(&profile[i]);
+                }
+            }
+        }
+    }
+}
+
+/* apply populated profiles at once, drop them revert-delay after their cgroup empties; 1 if the fan must go up now */
+int profile_update(unsigned long long now)
+{
+    int floor_speed = 0;
+    int temp_offset = 0;
+
+    for (int i = 0; i < profile_num; i++)
+    {
+        struct profile_struct *p = &profile[i];
+        if (p->populated)
+        {
+            if (!p->active)
+            {
+                tlog(TLOG_NOTICE, "Workload %s started, profile active.", p->name);
+            }
+            p->active = 1;
+            p->exit_ms = 0;
+        }
+        else if (p->active)
+        {
+            if (p->exit_ms == 0)
+            {
+                p->exit_ms = now;
+            }
+
+            if (now - p->exit_ms >= (unsigned long long)p->revert_delay * 1000)
+            {
+                tlog(TLOG_NOTICE, "Workload %s gone for %ds, profile reverted.", p->name, p->revert_delay);
+                p->active = 0;
+            }
+        }
+
+        if (!p->active)
+        {
+            continue;
+        }
+
+        for (int j = 0; j < temp_map_size; j++)
+        {
+            if (temp_map[j].percent >= p->floor)
+            {
+                floor_speed = j > floor_speed ? j : floor_speed;
+                break;
+            }
+        }
+
+        temp_offset = p->temp_offset > temp_offset ? p->temp_offset : temp_offset;
+    }
+
+    int raised = floor_speed > profile_floor_speed || temp_offset > profile_temp_offset;
+    profile_floor_speed = floor_speed;
+    profile_temp_offset = temp_offset;
+    return raised;
+}
+
+int lease_init()
+{
+    struct sockaddr_un addr;
+
+    if (!lease_enable)
+    {
+        return 0;
+    }
+
+    lease_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lease_fd < 0)
+    {
+        tlog(TLOG_WARN, "Failed to create lease socket, %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, lease_socket, strlen(lease_socket));
+    unlink(lease_socket);
+    if (bind(lease_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(lease_socket, 0660) != 0)
+    {
+        tlog(TLOG_WARN, "Failed to bind lease socket %s, %s", lease_socket, strerror(errno));
+        close(lease_fd);
+        lease_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void lease_exit()
+{
+    if (lease_fd < 0)
+    {
+        return;
+    }
+
+    close(lease_fd);
+    lease_fd = -1;
+    unlink(lease_socket);
+}
+
+/* serve one request, "floor <percent> <seconds>", "target <celsius> <seconds>", "cancel <id>" or "list" */
+int lease_handle(const char *request, char *reply, int size)
+{
+    char cmd[16];
+    int value = 0;
+    int seconds = 0;
+    unsigned long long now = get_monotonic_ms();
+
+    if (sscanf(request, "%15s", cmd) != 1)
+    {
+        snprintf(reply, size, "error empty request");
+        return 0;
+    }
+
+    if (strcmp(cmd, "list") == 0)
+    {
+        int len = snprintf(reply, size, "ok %d", lease_num);
+        for (int i = 0; i < lease_num && len < size; i++)
+        {
+            len += snprintf(reply + len, size - len, "\n%u %s %d %llus", lease[i].id, lease[i].type == LEASE_FLOOR ? "floor" : "target",
+                            lease[i].value, (lease[i].expire_ms - now + 999) / 1000);
+        }
+        return 0;
+    }
+
+    if (strcmp(cmd, "cancel") == 0)
+    {
+        unsigned int id = 0;
+        if (sscanf(request, "%*s %u", &id) == 1)
+        {
+            for (int i = 0; i < lease_num; i++)
+            {
+                if (lease[i].id == id)
+                {
+                    lease[i] = lease[--lease_num];
+                    tlog(TLOG_NOTICE, "Lease %u cancelled.", id);
+                    snprintf(reply, size, "ok %u", id);
+                    return 0;
+                }
+            }
+        }
+        snprintf(reply, size, "error no such lease");
+        return 0;
+    }
+
+    int type = strcmp(cmd, "floor") == 0 ? LEASE_FLOOR : strcmp(cmd, "target") == 0 ? LEASE_TARGET : -1;
+    if (type < 0 || sscanf(request, "%*s %d %d", &value, &seconds) != 2)
+    {
+        snprintf(reply, size, "error usage: floor <percent> <seconds> | target <celsius> <seconds> | cancel <id> | list");
+        return 0;
+    }
+
+    if ((type == LEASE_FLOOR && (value < 0 || value > 100)) || (type == LEASE_TARGET && value <= failsafe_temp_min))
+    {
+        snprintf(reply, size, "error invalid %s %d", cmd, value);
+        return 0;
+    }
+
+    if (seconds <= 0 || seconds > lease_max_duration)
+    {
+        snprintf(reply, size, "error duration must be 1 to %d seconds", lease_max_duration);
+        return 0;
+    }
+
+    if (lease_num >= lease_max)
+    {
+        snprintf(reply, size, "error too many leases, max %d", lease_max);
+        return 0;
+    }
+
+    struct lease_struct *l = &lease[lease_num++];
+    l->id = lease_next_id++;
+    l->type = type;
+    l->value = value;
+    l->expire_ms = now + (unsigned long long)seconds * 1000;
+    tlog(TLOG_NOTICE, "Lease %u granted: %s %d for %ds.", l->id, cmd, value, seconds);
+    snprintf(reply, size, "ok %u", l->id);
+    return 1;
+}
+
+/* answer every queued request, return 1 if a lease was granted */
+int lease_serve()
+{
+    char request[256];
+    char reply[1024];
+    struct sockaddr_un from;
+    int granted = 0;
+
+    while (1)
+    {
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(lease_fd, request, sizeof(request) - 1, 0, (struct sockaddr *)&from, &from_len);
+        if (len < 0)
+        {
+            break;
+        }
+
+        request[len] = '\0';
+        granted |= lease_handle(request, reply, sizeof(reply));
+
+        /* an unbound client does not want the answer */
+        if (from_len > sizeof(sa_family_t))
+        {
+            sendto(lease_fd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL, (struct sockaddr *)&from, from_len);
+        }
+    }
+
+    return granted;
+}
+
+/* lowest speed the live leases allow at this temperature, dropping expired ones */
+int lease_floor_speed(int temperature)
+{
+    unsigned long long now = get_monotonic_ms();
+    int floor_speed = 0;
+
+    for (int i = 0; i < lease_num; i++)
+    {
+        struct lease_struct *l = &lease[i];
+        if (now >= l->expire_ms)
+        {
+            tlog(TLOG_NOTICE, "Lease %u expired.", l->id);
+            lease[i--] = lease[--lease_num];
+            continue;
+        }
+
+        int speed = 0;
+        if (l->type == LEASE_TARGET)
+        {
+            speed = temperature > l->value ? temp_map_size - 1 : 0;
+        }
+        else
+        {
+            for (speed = 0; speed < temp_map_size - 1 && temp_map[speed].percent < l->value; speed++)
+            {
+            }
+        }
+
+        floor_speed = speed > floor_speed ? speed : floor_speed;
+    }
+
+    return floor_speed;
+}
+
+/* send one request to the running service and print its answer */
+int lease_client(const char *request)
+{
+    struct sockaddr_un addr;
+    char reply[1024];
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        printf("Failed to create socket, %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* autobind an abstract address, so the service can reply */
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(sa_family_t)) != 0)
+    {
+        printf("Failed to bind socket, %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    memcpy(addr.sun_path, lease_socket, strlen(lease_socket));
+    if (sendto(fd, request, strlen(request), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        printf("Failed to send to %s, %s\n", lease_socket, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int len = poll(&pfd, 1, 2000) > 0 ? recv(fd, reply, sizeof(reply) - 1, 0) : -1;
+    close(fd);
+    if (len < 0)
+    {
+        printf("No reply from %s.\n", lease_socket);
+        return -1;
+    }
+
+    reply[len] = '\0';
+    printf("%s\n", reply);
+    return strncmp(reply, "ok", 2) == 0 ? 0 : -1;
+}
+
+/* sleep until next_tick, return 1 when a workload event or a lease needs a sample before then */
+int loop_wait(const struct timespec *next_tick)
+{
+    struct pollfd pfd[2];
+    int nfds = 0;
+
+    if (profile_inotify_fd >= 0)
+    {
+        pfd[nfds++] = (struct pollfd){profile_inotify_fd, POLLIN, 0};
+    }
+
+    if (lease_fd >= 0)
+    {
+        pfd[nfds++] = (struct pollfd){lease_fd, POLLIN, 0};
+    }
+
+    if (nfds == 0)
+    {
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next_tick, NULL) == EINTR)
+        {
+            if (show_memory_request || exit_request)
+            {
+                break;
+            }
+        }
+        return 0;
+    }
+
+    while (!show_memory_request && !exit_request)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long timeout = (next_tick->tv_sec - now.tv_sec) * 1000LL + (next_tick->tv_nsec - now.tv_nsec + 999999) / 1000000;
+        if (timeout <= 0)
+        {
+            break;
+        }
+
+        int ret = poll(pfd, nfds, (int)timeout);
+        if (ret == 0)
+        {
+            break;
+        }
+
+        if (ret < 0)
+        {
+            if (errno != EINTR)
+            {
+                tlog(TLOG_ERROR, "Failed to wait for events, %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        int early = 0;
+        for (int i = 0; i < nfds; i++)
+        {
+            if (!(pfd[i].revents & POLLIN))
+            {
+                continue;
+            }
+
+            if (pfd[i].fd == lease_fd)
+            {
+                early |= lease_serve();
+            }
+            else
+            {
+                profile_events();
+                early |= profile_update(get_monotonic_ms());
+            }
+        }
+
+        if (early)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void show_help(void)
+{
+    char *msg = "PI custom fan control service.\n"
+                "Usage: fan-control [option]\n"
+                "Options:\n"
+                "  -d       start as a daemon service.\n"
+                "  -p       specify a pid file path (default: /run/fan-control.pid)\n"
+                "  -s [0-6] set fan speed.\n"
+                "  -c       specify a config file path (default: /etc/fan-control.json)\n"
+                "  -r, --sysfs-root [dir]\n"
+                "           read and write sysfs below dir instead of /, for tests.\n"
+                "  --lease [request]\n"
+                "           ask the running service for headroom: \"floor <percent> <seconds>\",\n"
+                "           \"target <celsius> <seconds>\", \"cancel <id>\" or \"list\".\n"
+                "  --status[=file]\n"
+                "           print the live state published by the running service.\n"
+                "  -C, --characterize\n"
+                "           sweep the fan duty, measure its speed and write the calibration table.\n"
+                "  -h       show help message.\n"
+                "\n";
+    printf("%s", msg);
+}
+
+int init_pwm_gpio_by_ids(int chipId, int pwmId)
+{
+    int ret = 0;
+    char max_speed[16];
+
+    snprintf(max_speed, 15, "%d", temp_map[temp_map_size - 1].duty);
+    ret = write_pwmchip_value(chipId, "export", "0");
+    if (ret < 0 && errno != EBUSY)
+    {
+        tlog(TLOG_ERROR, "Failed to export GPIO, %s", strerror(errno));
+        return -1;
+    }
+
+    /* after a handover the fan keeps running, only clear the duty if the period cannot be set over it */
+    ret = handover.valid ? 0 : write_pwmchip_pwm_value(chipId, pwmId, "duty_cycle", "0");
+    if (ret < 0 && errno != EINVAL)
+    {
+        tlog(TLOG_ERROR, "Failed to export GPIO, %s", strerror(errno));
+        goto do_unexport;
+    }
+
+    ret = write_pwmchip_pwm_value(chipId, pwmId, "period", max_speed);
+    if (ret < 0 && handover.valid)
+    {
+        write_pwmchip_pwm_value(chipId, pwmId, "duty_cycle", "0");
+        ret = write_pwmchip_pwm_value(chipId, pwmId, "period", max_speed);
+    }
+
+    if (ret < 0)
+    {
+        tlog(TLOG_ERROR, "Failed to export GPIO, %s", strerror(errno));
+        goto do_unexport;
+    }
+
+    ret = write_pwmchip_pwm_value(chipId, pwmId, "polarity", "normal");
+    if (ret < 0)
+    {
+        tlog(TLOG_ERROR, "Failed to export GPIO, %s", strerror(errno));
+        goto do_unexport;
+    }
+
+    ret = write_pwmchip_pwm_value(chipId, pwmId, "enable", "1");
+    if (ret < 0)
+    {
+        tlog(TLOG_ERROR, "Failed to export GPIO, %s", strerror(errno));
+        goto do_unexport;
+    }
+
+    return 0;
+
+do_unexport:
+    write_pwmchip_value(chipId, "unexport", "0");
+    return -1;
+}
+
+int init_pwm_GPIO()
+{
+    if (pwmchip_id > 0)
+    {
+        if (init_pwm_gpio_by_ids(pwmchip_id, pwmchip_gpio_id) != 0)
+        {
+            tlog(TLOG_ERROR, "Failed to init pwmchip%d GPIO %d, %s", pwmchip_id, pwmchip_gpio_id, strerror(errno));
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < 6; i++)
+    {
+        if (init_pwm_gpio_by_ids(i, pwmchip_gpio_id) == 0)
+        {
+            pwmchip_id = i;
+            tlog(TLOG_INFO, "Found pwmchip%d", pwmchip_id);
+            fan_mode = 0;
+            return 0;
+        }
+    }
+
+    tlog(TLOG_ERROR, "Failed to init GPIO");
+    return -1;
+}
+
+int find_fan_hwmon()
+{
+    DIR *dir = opendir(fan_hwmon_path);
+    struct dirent *ent = NULL;
+
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strncmp(ent->d_name, "hwmon", 5) == 0)
+        {
+            snprintf(fan_hwmon_dir, sizeof(fan_hwmon_dir), "%s/%s", fan_hwmon_path, ent->d_name);
+            closedir(dir);
+            return 0;
+        }
+    }
+
+    closedir(dir);
+    return -1;
+}
+
+/* the user-space features a kernel governor cannot take over, NULL if there is none */
+const char *offload_blocker()
+{
+    if (control_mode != CONTROL_CURVE)
+    {
+        return "mpc control";
+    }
+
+    if (auto_tune_mode != AUTO_TUNE_OFF)
+    {
+        return "auto-tune";
+    }
+
+    if (shadow_curve_num > 0)
+    {
+        return "shadow curves";
+    }
+
+    if (passive_ceiling > 0)
+    {
+        return "passive cooling";
+    }
+
+    if (fallback_sensor_num > 0 || sensor_num > 1 || (sensor_num == 1 && strcmp(sensor[0].path, temp_path) != 0))
+    {
+        return "sensors other than thermal zone 0";
+    }
+
+    if (profile_num > 0)
+    {
+        return "workload profiles";
+    }
+
+    if (lease_enable)
+    {
+        return "the lease socket";
+    }
+
+    return NULL;
+}
+
+/* active trips of thermal zone 0 bound to the pwm-fan cooling device, coolest first */
+int offload_find_trips(int *trip, long long *trip_temp, int max)
+{
+    char file[1100];
+    char buff[64];
+    int num = 0;
+
+    for (int k = 0; k < 64; k++)
+    {
+        snprintf(file, sizeof(file), "%s/thermal_zone0/cdev%d/type", thermal_zone_path, k);
+        if (read_string(file, buff, sizeof(buff)) != 0 || strcmp(buff, "pwm-fan") != 0)
+        {
+            continue;
+        }
+
+        snprintf(file, sizeof(file), "%s/thermal_zone0/cdev%d_trip_point", thermal_zone_path, k);
+        if (read_string(file, buff, sizeof(buff)) != 0)
+        {
+            continue;
+        }
+
+        int id = atoi(buff);
+        snprintf(file, sizeof(file), "%s/thermal_zone0/trip_point_%d_type", thermal_zone_path, id);
+        if (read_string(file, buff, sizeof(buff)) != 0 || strcmp(buff, "active") != 0)
+        {
+            continue;
+        }
+
+        snprintf(file, sizeof(file), "%s/thermal_zone0/trip_point_%d_temp", thermal_zone_path, id);
+        if (read_string(file, buff, sizeof(buff)) != 0)
+        {
+            continue;
+        }
+
+        int dup = 0;
+        for (int i = 0; i < num; i++)
+        {
+            dup |= trip[i] == id;
+        }
+
+        if (dup || num >= max)
+        {
+            continue;
+        }
+
+        /* insertion by temperature */
+        long long temp = atoll(buff);
+        int i = num++;
+        while (i > 0 && trip_temp[i - 1] > temp)
+        {
+            trip[i] = trip[i - 1];
+            trip_temp[i] = trip_temp[i - 1];
+            i--;
+        }
+        trip[i] = id;
+        trip_temp[i] = temp;
+    }
+
+    return num;
+}
+
+/*
+ * Offload mode: move the temp-map thresholds onto the active trip points
+ * that the device tree binds to the pwm-fan cooling device, and give the
+ * zone back to a kernel governor. The fan states themselves are the
+ * cooling-levels of the device tree, sysfs cannot change them. Needs
+ * CONFIG_THERMAL_WRITABLE_TRIPS.
+ */
+int offload_thermal()
+{
+    int trip[MAX_OFFLOAD_TRIPS];
+    long long trip_temp[MAX_OFFLOAD_TRIPS];
+    int level[MAX_TEMP_MAP_SIZE];
+    int level_num = 0;
+    char file[1100];
+    char buff[32];
+
+    const char *blocker = offload_blocker();
+    if (blocker != NULL)
+    {
+        tlog(TLOG_WARN, "Cannot offload to the kernel with %s configured, keep user-space control.", blocker);
+        return -1;
+    }
+
+    /* the kernel turns the fan on at the first trip, the levels with the fan off need none */
+    for (int i = 0; i < temp_map_size; i++)
+    {
+        if (temp_map[i].percent > 0)
+        {
+            level[level_num++] = i;
+        }
+    }
+
+    int trip_num = offload_find_trips(trip, trip_temp, MAX_OFFLOAD_TRIPS);
+    if (trip_num == 0 || level_num == 0)
+    {
+        tlog(TLOG_WARN, "No active trip point bound to pwm-fan, keep user-space control.");
+        return -1;
+    }
+
+    if (trip_num < level_num)
+    {
+        tlog(TLOG_WARN, "Only %d trip points for %d temp-map levels, the fan reaches its top state at level %d.", trip_num,
+             level_num, level[trip_num - 1]);
+    }
+
+    for (int i = 0; i < trip_num; i++)
+    {
+        int speed = level[i < level_num ? i : level_num - 1];
+
+        snprintf(file, sizeof(file), "%s/thermal_zone0/trip_point_%d_temp", thermal_zone_path, trip[i]);
+        snprintf(buff, sizeof(buff), "%d", temp_map[speed].temp * 1000);
+        if (write_value(file, buff) != 0)
+        {
+            tlog(TLOG_WARN, "Trip point %d is not writable, %s, keep user-space control.", trip[i], strerror(errno));
+            return -1;
+        }
+
+        snprintf(file, sizeof(file), "%s/thermal_zone0/trip_point_%d_hyst", thermal_zone_path, trip[i]);
+        snprintf(buff, sizeof(buff), "%d", offload_hysteresis * 1000);
+        write_value(file, buff);
+        tlog(TLOG_INFO, "Trip point %d at %d degrees for temp-map level %d.", trip[i], temp_map[speed].temp, speed);
+    }
+
+    if (write_thermal_zone_value("policy", offload_governor) != 0)
+    {
+        tlog(TLOG_ERROR, "Failed to set thermal policy %s, %s", offload_governor, strerror(errno));
+        return -1;
+    }
+
+    if (write_thermal_zone_value("mode", "enabled") != 0)
+    {
+        tlog(TLOG_ERROR, "Failed to enable thermal zone, %s", strerror(errno));
+        return -1;
+    }
+
+    tlog(TLOG_NOTICE, "Fan control offloaded to the %s governor, duty follows the device tree cooling-levels.",
+         offload_governor);
+    if (throttle_detect)
+    {
+        tlog(TLOG_INFO, "Throttle detection is not available in offload mode.");
+    }
+
+    return 0;
+}
+
+/* the kernel does the work, stay around for the service manager until asked to stop or reload */
+void offload_park()
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sig_exit;
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGUSR2, &act, NULL);
+
+    /* signals stay blocked except inside pselect(), so a request cannot slip in before the sleep */
+    sigset_t block, orig;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGHUP);
+    sigaddset(&block, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &block, &orig);
+
+    /* nothing can stall here, keep the service watchdog fed */
+    unsigned long long sleep_ms = notify_watchdog_ms > 0 ? notify_watchdog_ms / 2 : 3600 * 1000;
+    struct timespec ts = {sleep_ms / 1000, (long)(sleep_ms % 1000) * 1000000};
+    while (!exit_request)
+    {
+        notify_send("WATCHDOG=1");
+        pselect(0, NULL, NULL, NULL, &ts, &orig);
+    }
+    sigprocmask(SIG_SETMASK, &orig, NULL);
+}
+
+int init_thermal()
+{
+    int ret = write_thermal_zone_value("policy", "user_space");
+    if (ret < 0)
+    {
+        tlog(TLOG_ERROR, "Failed to set thermal policy, %s", strerror(errno));
+        return -1;
+    }
+
+    ret = write_thermal_zone_value("mode", "disabled");
+    if (ret < 0)
+    {
+        tlog(TLOG_ERROR, "Failed to set thermal mode, %s", strerror(errno));
+        return -1;
+    }
+
+    fan_mode = 1;
+    if (find_fan_hwmon() != 0)
+    {
+        tlog(TLOG_WARN, "pwm-fan hwmon not found, use %s", fan_hwmon_dir);
+    }
+
+    return 0;
+}
+
+int open_cpufreq_value(int policy, const char *key)
+{
+    char file[1024];
+    snprintf(file, sizeof(file), "%s/policy%d/%s", cpufreq_path, policy, key);
+    return open(file, O_RDONLY | O_CLOEXEC);
+}
+
+int open_throttle_count(int policy)
+{
+    char file[1024];
+    char buff[TMP_BUFF_LEN_32] = {0};
+    int fd = open_cpufreq_value(policy, "related_cpus");
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int len = pread(fd, buff, sizeof(buff) - 1, 0);
+    close(fd);
+    if (len <= 0)
+    {
+        return -1;
+    }
+
+    snprintf(file, sizeof(file), "%s/cpu%d/thermal_throttle/core_throttle_count", cpu_path, atoi(buff));
+    return open(file, O_RDONLY | O_CLOEXEC);
+}
+
+void close_cpufreq_policy(struct cpufreq_policy_struct *policy)
+{
+    if (policy->fd_cur >= 0)
+    {
+        close(policy->fd_cur);
+    }
+
+    if (policy->fd_hw >= 0)
+    {
+        close(policy->fd_hw);
+    }
+
+    if (policy->fd_max >= 0)
+    {
+        close(policy->fd_max);
+    }
+
+    if (policy->fd_throttle >= 0)
+    {
+        close(policy->fd_throttle);
+    }
+}
+
+int init_throttle_detect()
+{
+    cpufreq_policy_num = 0;
+    for (int i = 0; i < MAX_CPUFREQ_POLICY * 2 && cpufreq_policy_num < MAX_CPUFREQ_POLICY; i++)
+    {
+        struct cpufreq_policy_struct *policy = &cpufreq_policy[cpufreq_policy_num];
+
+        policy->id = i;
+        policy->fd_cur = open_cpufreq_value(i, "scaling_cur_freq");
+        if (policy->fd_cur < 0)
+        {
+            continue;
+        }
+
+        policy->fd_hw = open_cpufreq_value(i, "cpuinfo_cur_freq");
+        policy->fd_max = open_cpufreq_value(i, "scaling_max_freq");
+        policy->fd_throttle = open_throttle_count(i);
+        policy->base_max = 0;
+        policy->throttle_count = 0;
+        if (policy->fd_max < 0 || read_fd_value(policy->fd_max, &policy->base_max) != 0)
+        {
+            policy->base_max = 0;
+        }
+
+        if (policy->fd_throttle >= 0 && read_fd_value(policy->fd_throttle, &policy->throttle_count) != 0)
+        {
+            close(policy->fd_throttle);
+            policy->fd_throttle = -1;
+        }
+
+        policy->cap = 0;
+        policy->slow_samples = 0;
+        policy->min_freq = 0;
+        snprintf(policy->max_path, sizeof(policy->max_path), "%s/policy%d/scaling_max_freq", cpufreq_path, i);
+        int fd_min = open_cpufreq_value(i, "cpuinfo_min_freq");
+        if (fd_min >= 0)
+        {
+            read_fd_value(fd_min, &policy->min_freq);
+            close(fd_min);
+        }
+
+        if (policy->fd_hw < 0 && policy->base_max == 0 && policy->fd_throttle < 0)
+        {
+            close_cpufreq_policy(policy);
+            continue;
+        }
+
+        policy->id_cur = sysfs_read_register(policy->fd_cur);
+        policy->id_hw = sysfs_read_register(policy->fd_hw);
+        policy->id_max = sysfs_read_register(policy->fd_max);
+        policy->id_throttle = sysfs_read_register(policy->fd_throttle);
+
+        cpufreq_policy_num++;
+    }
+
+    if (cpufreq_policy_num == 0)
+    {
+        tlog(TLOG_WARN, "No cpufreq policy found, throttle detection and passive cooling disabled.");
+        return -1;
+    }
+
+    return 0;
+}
+
+int check_policy_throttled(struct cpufreq_policy_struct *policy)
+{
+    long long cur = 0;
+    long long value = 0;
+    int throttled = 0;
+
+    /* the hardware runs slower than the governor asked for, for several samples in a row */
+    if (sysfs_read_value(policy->id_cur, &cur) == 0 && sysfs_read_value(policy->id_hw, &value) == 0)
+    {
+        int slow = value > 0 && value * 100 < cur * (100 - THROTTLE_FREQ_TOLERANCE);
+        policy->slow_samples = slow ? policy->slow_samples + 1 : 0;
+        if (policy->slow_samples >= THROTTLE_FREQ_SAMPLES)
+        {
+            throttled = 1;
+        }
+    }
+
+    /* someone capped the policy below the limit it started with, our own passive cap does not count */
+    if (policy->base_max > 0 && sysfs_read_value(policy->id_max, &value) == 0)
+    {
+        if (value < (policy->cap > 0 ? policy->cap : policy->base_max))
+        {
+            throttled = 1;
+        }
+        else if (policy->cap == 0)
+        {
+            policy->base_max = value;
+        }
+    }
+
+    if (sysfs_read_value(policy->id_throttle, &value) == 0)
+    {
+        if (value > policy->throttle_count)
+        {
+            throttled = 1;
+        }
+        policy->throttle_count = value;
+    }
+
+    return throttled;
+}
+
+int check_throttle(void)
+{
+    static unsigned long long last_check_ms = 0;
+    unsigned long long now = get_monotonic_ms();
+    int throttled = 0;
+
+    for (int i = 0; i < cpufreq_policy_num; i++)
+    {
+        if (check_policy_throttled(&cpufreq_policy[i]))
+        {
+            throttled = 1;
+        }
+    }
+
+    if (throttle_active && last_check_ms > 0)
+    {
+        throttle_ms += now - last_check_ms;
+    }
+
+    last_check_ms = now;
+    throttle_active = throttled;
+    return throttled;
+}
+
+int passive_set_level(int level)
+{
+    int ret = 0;
+
+    for (int i = 0; i < cpufreq_policy_num; i++)
+    {
+        struct cpufreq_policy_struct *policy = &cpufreq_policy[i];
+        char buff[24];
+        if (policy->base_max <= 0)
+        {
+            continue;
+        }
+
+        long long floor = policy->min_freq + (policy->base_max - policy->min_freq) * passive_floor / 100;
+        long long cap = policy->base_max - (policy->base_max - policy->min_freq) * passive_step * level / 100;
+        if (cap < floor)
+        {
+            cap = floor;
+        }
+
+        if (level == 0 || cap >= policy->base_max)
+        {
+            cap = 0;
+        }
+
+        if (cap == policy->cap)
+        {
+            continue;
+        }
+
+        if (policy->cap == 0)
+        {
+            snprintf(policy->restore_value, sizeof(policy->restore_value), "%lld", policy->base_max);
+        }
+
+        snprintf(buff, sizeof(buff), "%lld", cap > 0 ? cap : policy->base_max);
+        if (write_value(policy->max_path, buff) != 0)
+        {
+            tlog_ratelimit(TLOG_ERROR, "Failed to set %s, %s", policy->max_path, strerror(errno));
+            ret = -1;
+            continue;
+        }
+
+        policy->cap = cap;
+    }
+
+    return ret;
+}
+
+/*
+ * Passive cooling stage. While the fan runs at its top level and the
+ * temperature is above the ceiling and not falling, lower the frequency
+ * limit by one step per sample. Below ceiling - hysteresis the limit is
+ * raised two steps per sample, and dropped at once below ceiling - 2 *
+ * hysteresis, so throughput comes back as soon as the fan copes again.
+ */
+void passive_update(int temperature, int speed)
+{
+    static int last_temperature = INT_MIN;
+    int level = passive_level;
+    int max_level = (100 - passive_floor + passive_step - 1) / passive_step;
+
+    if (speed >= temp_map_size - 1 && temperature > passive_ceiling && temperature >= last_temperature)
+    {
+        level = passive_level < max_level ? passive_level + 1 : max_level;
+    }
+    else if (temperature < passive_ceiling - passive_hysteresis * 2)
+    {
+        level = 0;
+    }
+    else if (temperature < passive_ceiling - passive_hysteresis)
+    {
+        level = passive_level > 2 ? passive_level - 2 : 0;
+    }
+
+    last_temperature = temperature;
+    if (level == passive_level)
+    {
+        return;
+    }
+
+    if (passive_set_level(level) == 0)
+    {
+        tlog(level > passive_level ? TLOG_NOTICE : TLOG_INFO, "Passive cooling at temperature %d, cpu frequency cap level %d.",
+             temperature, level);
+    }
+    passive_level = level;
+}
+
+const char *auto_tune_mode_name(int mode)
+{
+    switch (mode)
+    {
+    case AUTO_TUNE_PROPOSE:
+        return "propose";
+    case AUTO_TUNE_APPLY:
+        return "apply";
+    default:
+        break;
+    }
+
+    return "off";
+}
+
+void auto_tune_init()
+{
+    thermal_model_init(&auto_tune_model, auto_tune_ambient);
+    memset(auto_tune_level, 0, sizeof(auto_tune_level));
+    for (int i = 0; i < temp_map_size; i++)
+    {
+        auto_tune_level[i].duty = temp_map[i].percent;
+    }
+}
+
+void auto_tune_propose()
+{
+    int top_duty = temp_map[temp_map_size - 1].percent;
+    int last_duty = 0;
+
+    /* the top level stays at its configured duty, it is the last line of defence */
+    for (int i = 0; i < temp_map_size - 1; i++)
+    {
+        struct auto_tune_level_struct *level = &auto_tune_level[i];
+        if (thermal_model_valid(&auto_tune_model) && level->samples >= 60)
+        {
+            double duty = thermal_model_duty(&auto_tune_model, level->heat, auto_tune_ceiling);
+            level->duty = (int)(duty * 100 + 0.999);
+        }
+
+        if (level->duty < last_duty)
+        {
+            level->duty = last_duty;
+        }
+
+        if (level->duty > top_duty)
+        {
+            level->duty = top_duty;
+        }
+
+        last_duty = level->duty;
+    }
+
+    auto_tune_level[temp_map_size - 1].duty = top_duty;
+}
+
+int write_state_file(const char *file, const char *data, int len)
+{
+    char tmp_file[1100];
+    char dir[1024];
+    int fd = -1;
+
+    strncpy(dir, file, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    mkdir(dirname(dir), 0755);
+
+    /* write aside and rename, a crash never leaves a truncated state file */
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", file);
+    fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (write(fd, data, len) != len)
+    {
+        close(fd);
+        unlink(tmp_file);
+        return -1;
+    }
+
+    if (close(fd) != 0 || rename(tmp_file, file) != 0)
+    {
+        unlink(tmp_file);
+        return -1;
+    }
+
+    return 0;
+}
+
+int auto_tune_save()
+{
+    FIXED_STORAGE char buff[MAX_STATE_FILE_SIZE];
+    jsonWriter_t writer;
+
+    json_writerInit(&writer, buff, sizeof(buff), true);
+    json_writeObjOpen(&writer, NULL);
+    json_writeObjOpen(&writer, "model");
+    json_writeReal(&writer, "heat", auto_tune_model.theta[THERMAL_MODEL_HEAT]);
+    json_writeReal(&writer, "cool", auto_tune_model.theta[THERMAL_MODEL_COOL]);
+    json_writeReal(&writer, "cool-duty", auto_tune_model.theta[THERMAL_MODEL_COOL_DUTY]);
+    json_writeInteger(&writer, "samples", auto_tune_model.samples);
+    json_writeObjClose(&writer);
+    json_writeArrOpen(&writer, "temp-map");
+    for (int i = 0; i < temp_map_size; i++)
+    {
+        json_writeObjOpen(&writer, NULL);
+        json_writeInteger(&writer, "temp", temp_map[i].temp);
+        json_writeInteger(&writer, "duty", auto_tune_level[i].duty);
+        json_writeReal(&writer, "heat", auto_tune_level[i].heat);
+        json_writeObjClose(&writer);
+    }
+    json_writeArrClose(&writer);
+    json_writeObjClose(&writer);
+
+    int len = json_writerEnd(&writer);
+    if (len < 0)
+    {
+        tlog(TLOG_ERROR, "Auto-tune state is too large.");
+        return -1;
+    }
+
+    if (write_state_file(auto_tune_file, buff, len) != 0)
+    {
+        tlog(TLOG_ERROR, "Failed to write auto-tune state file, %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* lookups while parsing the config go through a hash index, other files are small */
+jsonIndex_t conf_json_index;
+
+json_t const *conf_get_property(json_t const *obj, const char *name)
+{
+    return json_getPropertyIndexed(&conf_json_index, obj, name);
+}
+
+double json_get_number(json_t const *obj, const char *name)
+{
+    json_t const *field = conf_get_property(obj, name);
+    if (field == NULL)
+    {
+        return 0;
+    }
+
+    if (json_getType(field) != JSON_REAL && json_getType(field) != JSON_INTEGER)
+    {
+        return 0;
+    }
+
+    return json_getReal(field);
+}
+
+/* a string property: *value is NULL when it is absent, -1 when it has another type */
+int conf_get_text(json_t const *obj, const char *section, const char *name, const char **value)
+{
+    json_t const *field = conf_get_property(obj, name);
+
+    *value = NULL;
+    if (field == NULL)
+    {
+        return 0;
+    }
+
+    if (json_getType(field) != JSON_TEXT)
+    {
+        tlog(TLOG_ERROR, "Invalid %s %s field, must be a string.", section, name);
+        return -1;
+    }
+
+    *value = json_getValue(field);
+    return 0;
+}
+
+int auto_tune_load()
+{
+    FIXED_STORAGE char str[MAX_STATE_FILE_SIZE];
+    enum
+    {
+        MAX_FIELDS = 256
+    };
+    FIXED_STORAGE json_t pool[MAX_FIELDS];
+    int fd = 0;
+    int len = 0;
+
+    fd = open(auto_tune_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    memset(str, 0, sizeof(str));
+    len = read(fd, str, sizeof(str) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return -1;
+    }
+
+    json_t const *parent = json_create(str, pool, MAX_FIELDS);
+    if (parent == NULL)
+    {
+        tlog(TLOG_ERROR, "Invalid auto-tune state file %s.", auto_tune_file);
+        return -1;
+    }
+
+    json_t const *model = json_getProperty(parent, "model");
+    if (model != NULL && json_getType(model) == JSON_OBJ)
+    {
+        thermal_model_set(&auto_tune_model, json_get_number(model, "heat"), json_get_number(model, "cool"),
+                          json_get_number(model, "cool-duty"), (unsigned long)json_get_number(model, "samples"));
+    }
+
+    json_t const *temp_map_array = json_getProperty(parent, "temp-map");
+    if (temp_map_array == NULL || json_getType(temp_map_array) != JSON_ARRAY)
+    {
+        return 0;
+    }
+
+    /* learned duties only fit the curve they were learned for */
+    int id = 0;
+    json_t const *temp_obj;
+    for (temp_obj = json_getChild(temp_map_array); temp_obj != 0; temp_obj = json_getSibling(temp_obj))
+    {
+        if (id >= temp_map_size || (int)json_get_number(temp_obj, "temp") != temp_map[id].temp)
+        {
+            tlog(TLOG_WARN, "Auto-tune state does not match temp-map, ignore learned duties.");
+            auto_tune_init();
+            return 0;
+        }
+        id++;
+    }
+
+    if (id != temp_map_size)
+    {
+        return 0;
+    }
+
+    id = 0;
+    for (temp_obj = json_getChild(temp_map_array); temp_obj != 0; temp_obj = json_getSibling(temp_obj))
+    {
+        auto_tune_level[id].duty = (int)json_get_number(temp_obj, "duty");
+        auto_tune_level[id].heat = json_get_number(temp_obj, "heat");
+        auto_tune_level[id].samples = auto_tune_level[id].heat > 0 ? 60 : 0;
+        id++;
+    }
+
+    return 0;
+}
+
+/* cpu load proxy from the frequencies already sampled for throttle detection, 1 without cpufreq */
+double efficiency_load()
+{
+    double load = 0;
+    int num = 0;
+
+    for (int i = 0; i < cpufreq_policy_num; i++)
+    {
+        long long cur = 0;
+        if (cpufreq_policy[i].base_max > 0 && sysfs_read_value(cpufreq_policy[i].id_cur, &cur) == 0)
+        {
+            load += (double)cur / cpufreq_policy[i].base_max;
+            num++;
+        }
+    }
+
+    return num > 0 ? load / num : 1;
+}
+
+double efficiency_estimate(struct efficiency_struct *e)
+{
+    return e->sxx > 0 ? e->sxy / e->sxx : 0;
+}
+
+int efficiency_save()
+{
+    FIXED_STORAGE char buff[MAX_STATE_FILE_SIZE];
+    jsonWriter_t writer;
+
+    json_writerInit(&writer, buff, sizeof(buff), true);
+    json_writeObjOpen(&writer, NULL);
+    json_writeArrOpen(&writer, "baseline");
+    for (int i = 0; i < sensor_num; i++)
+    {
+        for (int j = 0; j < temp_map_size; j++)
+        {
+            if (efficiency[i][j].baseline <= 0)
+            {
+                continue;
+            }
+
+            json_writeObjOpen(&writer, NULL);
+            json_writeText(&writer, "sensor", sensor[i].path);
+            json_writeInteger(&writer, "duty", temp_map[j].percent);
+            json_writeReal(&writer, "resistance", efficiency[i][j].baseline);
+            json_writeObjClose(&writer);
+        }
+    }
+    json_writeArrClose(&writer);
+    json_writeObjClose(&writer);
+
+    int len = json_writerEnd(&writer);
+    if (len < 0)
+    {
+        tlog(TLOG_ERROR, "Efficiency state is too large.");
+        return -1;
+    }
+
+    if (write_state_file(efficiency_file, buff, len) != 0)
+    {
+        tlog(TLOG_ERROR, "Failed to write efficiency state file, %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* baselines are matched by sensor path and duty, so they survive restarts and curve edits */
+int efficiency_load_baseline()
+{
+    FIXED_STORAGE char str[MAX_STATE_FILE_SIZE];
+    enum
+    {
+        MAX_FIELDS = 256
+    };
+    FIXED_STORAGE json_t pool[MAX_FIELDS];
+
+    memset(efficiency, 0, sizeof(efficiency));
+    int fd = open(efficiency_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    memset(str, 0, sizeof(str));
+    int len = read(fd, str, sizeof(str) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return -1;
+    }
+
+    json_t const *parent = json_create(str, pool, MAX_FIELDS);
+    if (parent == NULL)
+    {
+        tlog(TLOG_ERROR, "Invalid efficiency state file %s.", efficiency_file);
+        return -1;
+    }
+
+    json_t const *baseline = json_getProperty(parent, "baseline");
+    if (baseline == NULL || json_getType(baseline) != JSON_ARRAY)
+    {
+        return -1;
+    }
+
+    json_t const *obj;
+    for (obj = json_getChild(baseline); obj != 0; obj = json_getSibling(obj))
+    {
+        const char *path = json_getPropertyValue(obj, "sensor");
+        int duty = (int)json_get_number(obj, "duty");
+        if (path == NULL)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < sensor_num; i++)
+        {
+            for (int j = 0; j < temp_map_size; j++)
+            {
+                if (strcmp(sensor[i].path, path) == 0 && temp_map[j].percent == duty)
+                {
+                    efficiency[i][j].baseline = json_get_number(obj, "resistance");
+                    efficiency[i][j].seconds = efficiency_warmup;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+void efficiency_update(int speed)
+{
+    double decay = 1.0 - 0.693147 * loop_interval_ms / 1000.0 / efficiency_half_life;
+    double load = efficiency_load();
+    int drift = 0;
+    int new_baseline = 0;
+
+    if (speed < 0 || speed >= temp_map_size)
+    {
+        return;
+    }
+
+    if (decay < 0)
+    {
+        decay = 0;
+    }
+
+    for (int i = 0; i < sensor_num; i++)
+    {
+        struct efficiency_struct *e = &efficiency[i][speed];
+        if (!sensor[i].valid)
+        {
+            continue;
+        }
+
+        double rise = sensor[i].value / 1000.0 - efficiency_ambient;
+        e->sxx = e->sxx * decay + load * load;
+        e->sxy = e->sxy * decay + load * rise;
+        e->seconds += loop_interval_ms / 1000.0;
+        if (e->seconds < efficiency_warmup)
+        {
+            continue;
+        }
+
+        double r = efficiency_estimate(e);
+        if (e->baseline <= 0)
+        {
+            e->baseline = r;
+            new_baseline = r > 0;
+            continue;
+        }
+
+        if ((r - e->baseline) * 100 > e->baseline * efficiency_drift)
+        {
+            drift = 1;
+        }
+    }
+
+    if (new_baseline)
+    {
+        efficiency_save();
+    }
+
+    /* only the level the fan is at has fresh samples, keep the flag until that level recovers */
+    if (drift && !(fault_flags & FAULT_COOLING_DRIFT))
+    {
+        tlog(TLOG_WARN, "Cooling efficiency dropped by more than %d%% at level %d, check the fan and the filters.",
+             efficiency_drift, speed);
+        atomic_fetch_or(&fault_flags, FAULT_COOLING_DRIFT);
+    }
+    else if (!drift && (fault_flags & FAULT_COOLING_DRIFT))
+    {
+        int any = 0;
+        for (int i = 0; i < sensor_num; i++)
+        {
+            struct efficiency_struct *e = &efficiency[i][speed];
+            any |= e->seconds >= efficiency_warmup && e->baseline > 0;
+        }
+
+        if (any)
+        {
+            atomic_fetch_and(&fault_flags, ~FAULT_COOLING_DRIFT);
+            tlog(TLOG_NOTICE, "Cooling efficiency back within %d%%.", efficiency_drift);
+        }
+    }
+}
+
+void efficiency_show()
+{
+    if (!efficiency_enable)
+    {
+        return;
+    }
+
+    for (int i = 0; i < sensor_num; i++)
+    {
+        for (int j = 0; j < temp_map_size; j++)
+        {
+            struct efficiency_struct *e = &efficiency[i][j];
+            if (e->sxx <= 0 && e->baseline <= 0)
+            {
+                continue;
+            }
+
+            tlog(TLOG_NOTICE, "efficiency %s level %d: resistance %.2f, baseline %.2f, %.0fs sampled", sensor[i].path, j,
+                 efficiency_estimate(e), e->baseline, e->seconds);
+        }
+    }
+}
+
+unsigned long long get_boottime_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* a saved hysteresis state only makes sense for the same curve */
+unsigned int handover_curve_hash()
+{
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < temp_map_size; i++)
+    {
+        int v[3] = {temp_map[i].temp, temp_map[i].duty, temp_map[i].duration};
+        for (int k = 0; k < 3; k++)
+        {
+            hash = (hash ^ (unsigned int)v[k]) * 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+/* held: the fan is left at the current speed, otherwise it was set to the safe duty */
+int handover_save(int held)
+{
+    char buff[512];
+    jsonWriter_t writer;
+
+    json_writerInit(&writer, buff, sizeof(buff), true);
+    json_writeObjOpen(&writer, NULL);
+    json_writeInteger(&writer, "time", get_boottime_ms());
+    json_writeInteger(&writer, "speed", set_speed_last);
+    json_writeBoolean(&writer, "held", held);
+    json_writeInteger(&writer, "curve-hash", handover_curve_hash());
+    json_writeObjOpen(&writer, "curve");
+    json_writeInteger(&writer, "last-speed", active_curve_state.last_speed);
+    json_writeInteger(&writer, "last-temperature", active_curve_state.last_temperature);
+    json_writeInteger(&writer, "count", active_curve_state.count);
+    json_writeObjClose(&writer);
+    json_writeObjClose(&writer);
+
+    int len = json_writerEnd(&writer);
+    if (len < 0 || write_state_file(handover_file, buff, len) != 0)
+    {
+        tlog(TLOG_ERROR, "Failed to write handover state %s, %s", handover_file, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* read the state of the previous instance, once; it is removed so it is never applied twice */
+int handover_load()
+{
+    char str[512];
+    json_t pool[16];
+
+    memset(&handover, 0, sizeof(handover));
+    int fd = open(handover_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    memset(str, 0, sizeof(str));
+    int len = read(fd, str, sizeof(str) - 1);
+    close(fd);
+    unlink(handover_file);
+    if (len <= 0)
+    {
+        return -1;
+    }
+
+    json_t const *parent = json_create(str, pool, sizeof(pool) / sizeof(pool[0]));
+    json_t const *curve = parent ? json_getProperty(parent, "curve") : NULL;
+    if (curve == NULL || json_getType(curve) != JSON_OBJ)
+    {
+        tlog(TLOG_WARN, "Invalid handover state %s.", handover_file);
+        return -1;
+    }
+
+    unsigned long long age = get_boottime_ms() - (unsigned long long)json_get_number(parent, "time");
+    if (age > (unsigned long long)handover_timeout * 1000)
+    {
+        tlog(TLOG_INFO, "Handover state is %llus old, start fresh.", age / 1000);
+        return -1;
+    }
+
+    handover.speed = (int)json_get_number(parent, "speed");
+    json_t const *held = json_getProperty(parent, "held");
+    handover.held = held != NULL && json_getType(held) == JSON_BOOLEAN && json_getBoolean(held);
+    handover.curve_hash = (unsigned int)json_get_number(parent, "curve-hash");
+    handover.curve.last_speed = (int)json_get_number(curve, "last-speed");
+    handover.curve.last_temperature = (int)json_get_number(curve, "last-temperature");
+    handover.curve.count = (int)json_get_number(curve, "count");
+    handover.valid = 1;
+    return 0;
+}
+
+/* continue where the previous instance stopped: same duty, no kick, same hysteresis */
+void handover_apply()
+{
+    if (!handover.valid)
+    {
+        return;
+    }
+
+    if (handover.held && handover.speed >= 0 && handover.speed < temp_map_size)
+    {
+        set_speed_last = handover.speed;
+    }
+    else if (failsafe_safe_duty > 0)
+    {
+        /* spinning at the safe duty, the first write needs no kick; no level matches it */
+        set_speed_last = temp_map_size;
+    }
+
+    if (handover.curve_hash == handover_curve_hash())
+    {
+        active_curve_state = handover.curve;
+    }
+
+    tlog(TLOG_NOTICE, "Took over at speed %d%s%s.", handover.speed, handover.held ? "" : " after a stop",
+         handover.curve_hash == handover_curve_hash() ? "" : ", temp-map changed, hysteresis restarts");
+}
+
+int auto_tune_deferred = 0;
+
+void auto_tune_apply(int speed, int temperature)
+{
+    int changed = 0;
+
+    /* never wait for a fan write in progress, try again on the next sample */
+    if (actuator_running && pthread_mutex_trylock(&curve_lock) != 0)
+    {
+        auto_tune_deferred = 1;
+        return;
+    }
+    auto_tune_deferred = 0;
+
+    for (int i = 0; i < temp_map_size; i++)
+    {
+        int duty = duty_from_percent(auto_tune_level[i].duty);
+        temp_map[i].percent = auto_tune_level[i].duty;
+        if (temp_map[i].duty != duty)
+        {
+            temp_map[i].duty = duty;
+            changed = (i == speed) ? 1 : changed;
+        }
+    }
+
+    if (actuator_running)
+    {
+        pthread_mutex_unlock(&curve_lock);
+        if (changed)
+        {
+            /* the actuator rewrites the level, the sampler never writes the fan itself */
+            struct speed_decision_struct decision = {get_monotonic_ms(), temperature, speed};
+            atomic_fetch_add(&curve_generation, 1);
+            decision_publish(&decision);
+        }
+        return;
+    }
+
+    if (changed)
+    {
+        write_speed(speed);
+    }
+}
+
+void auto_tune_show()
+{
+    tlog(TLOG_INFO, "auto-tune: heat %.4f, cool %.5f, cool-duty %.5f, samples %lu%s", auto_tune_model.theta[THERMAL_MODEL_HEAT],
+           auto_tune_model.theta[THERMAL_MODEL_COOL], auto_tune_model.theta[THERMAL_MODEL_COOL_DUTY], auto_tune_model.samples,
+           thermal_model_valid(&auto_tune_model) ? "" : " (learning)");
+    for (int i = 0; i < temp_map_size; i++)
+    {
+        tlog(TLOG_INFO, "  temp: %d, duty: %d%% -> %d%%", temp_map[i].temp, temp_map[i].percent, auto_tune_level[i].duty);
+    }
+}
+
+void auto_tune_sample(int temperature, int speed)
+{
+    static double last_temp = 0;
+    static double last_duty = 0;
+    static double heat = 0;
+    static unsigned long long last_ms = 0;
+    static unsigned long long last_update_ms = 0;
+    unsigned long long now = get_monotonic_ms();
+    double temp = temperature / 1000.0;
+    double dt = (now - last_ms) / 1000.0;
+
+    /* skip the first sample and gaps such as a system suspend */
+    if (last_ms > 0 && dt > 0 && dt < 10)
+    {
+        thermal_model_update(&auto_tune_model, last_temp, temp, last_duty, dt);
+        heat += (thermal_model_heat(&auto_tune_model, last_temp, temp, last_duty, dt) - heat) * 0.05;
+
+        if (speed >= 0 && speed < temp_map_size)
+        {
+            struct auto_tune_level_struct *level = &auto_tune_level[speed];
+            level->heat *= 0.9995;
+            if (heat > level->heat)
+            {
+                level->heat = heat;
+            }
+            level->samples++;
+        }
+    }
+
+    if (last_update_ms == 0)
+    {
+        last_update_ms = now;
+    }
+
+    if (now - last_update_ms >= (unsigned long long)auto_tune_interval * 1000)
+    {
+        last_update_ms = now;
+        auto_tune_propose();
+        auto_tune_show();
+        auto_tune_save();
+        if (auto_tune_mode == AUTO_TUNE_APPLY && thermal_model_valid(&auto_tune_model))
+        {
+            auto_tune_apply(speed, temperature);
+        }
+    }
+    else if (auto_tune_deferred)
+    {
+        auto_tune_apply(speed, temperature);
+    }
+
+    last_ms = now;
+    last_temp = temp;
+    last_duty = (speed >= 0 && speed < temp_map_size) ? (double)temp_map[speed].duty / duty_full_scale() : 0;
+}
+
+double duty_fraction(int speed)
+{
+    if (speed < 0 || speed >= temp_map_size)
+    {
+        return 0;
+    }
+
+    return (double)temp_map[speed].duty / duty_full_scale();
+}
+
+void mpc_init()
+{
+    memset(&mpc_state, 0, sizeof(mpc_state));
+    thermal_model_init(&mpc_state.model, mpc_ambient);
+    mpc_state.last_speed = -1;
+}
+
+/*
+ * Simulate holding level first for split steps and level second for the rest,
+ * with the heat input following the forecast. Returns the fan effort, or a
+ * negative value if the ceiling is crossed anywhere on the horizon.
+ */
+double mpc_trajectory_cost(double temp, int first, int second, int split, int steps, double dt)
+{
+    double effort = 0;
+
+    for (int i = 0; i < steps; i++)
+    {
+        int speed = i < split ? first : second;
+        double heat = mpc_state.heat + mpc_state.heat_trend * i * dt;
+        if (heat < 0)
+        {
+            heat = 0;
+        }
+
+        temp = thermal_model_predict(&mpc_state.model, temp, duty_fraction(speed), heat, dt);
+        if (temp > mpc_ceiling)
+        {
+            /* the steps spent on a rejected trajectory count against the budget too */
+            mpc_state.evaluations += i + 1;
+            return -1;
+        }
+
+        effort += duty_fraction(speed) * dt;
+    }
+
+    mpc_state.evaluations += steps;
+    return effort;
+}
+
+int mpc_solve(double temp)
+{
+    int steps = MPC_MAX_STEPS;
+    double dt = (double)mpc_horizon / steps;
+    int split = steps / 3;
+    int best = temp_map_size - 1;
+    double best_cost = -1;
+    int two_blocks = 0;
+
+    if (dt < loop_interval_ms / 1000.0)
+    {
+        dt = loop_interval_ms / 1000.0;
+        steps = (int)(mpc_horizon / dt);
+        split = steps / 3;
+    }
+
+    /* two move blocks when the budget allows, a single held level otherwise */
+    two_blocks = temp_map_size * temp_map_size * steps <= mpc_budget;
+    mpc_state.evaluations = 0;
+    for (int first = 0; first < temp_map_size; first++)
+    {
+        for (int second = two_blocks ? 0 : first; second < temp_map_size; second++)
+        {
+            if (mpc_state.evaluations + steps > mpc_budget)
+            {
+                break;
+            }
+
+            double cost = mpc_trajectory_cost(temp, first, second, two_blocks ? split : steps, steps, dt);
+
+            /* a small penalty for changing level keeps the fan from hunting */
+            if (cost >= 0 && first != mpc_state.last_speed)
+            {
+                cost += 0.02 * dt;
+            }
+
+            if (cost >= 0 && (best_cost < 0 || cost < best_cost))
+            {
+                best_cost = cost;
+                best = first;
+            }
+
+            /* a single held level has no second block to vary */
+            if (!two_blocks)
+            {
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+int mpc_get_speed(int temperature, int throttled)
+{
+    unsigned long long now = get_monotonic_ms();
+    double temp = temperature / 1000.0;
+    double dt = (now - mpc_state.last_ms) / 1000.0;
+    int speed = 0;
+
+    if (mpc_state.last_ms > 0 && dt > 0 && dt < 10)
+    {
+        thermal_model_update(&mpc_state.model, mpc_state.last_temp, temp, mpc_state.last_duty, dt);
+        double heat = thermal_model_heat(&mpc_state.model, mpc_state.last_temp, temp, mpc_state.last_duty, dt);
+        double last_heat = mpc_state.heat;
+        mpc_state.heat += (heat - mpc_state.heat) * 0.3;
+        mpc_state.heat_trend += ((mpc_state.heat - last_heat) / dt - mpc_state.heat_trend) * 0.1;
+    }
+
+    /* the curve drives the fan until the model has learned this enclosure */
+    speed = get_speed(temperature / 1000, throttled);
+    if (thermal_model_valid(&mpc_state.model))
+    {
+        speed = mpc_solve(temp);
+        if (throttled && speed <= mpc_state.last_speed && mpc_state.last_speed < temp_map_size - 1)
+        {
+            speed = mpc_state.last_speed + 1;
+        }
+    }
+
+    mpc_state.last_ms = now;
+    mpc_state.last_temp = temp;
+    mpc_state.last_duty = duty_fraction(speed);
+    mpc_state.last_speed = speed;
+    return speed;
+}
+
+int open_fan_tach()
+{
+    char file[1100];
+
+    if (fan_tach_path[0] != '\0')
+    {
+        return open(fan_tach_path, O_RDONLY | O_CLOEXEC);
+    }
+
+    /* no guessing: without the pwm-fan hwmon, e.g. on a bare pwmchip, fan-tach must be set */
+    if (find_fan_hwmon() != 0)
+    {
+        tlog(TLOG_ERROR, "pwm-fan hwmon not found, set fan-tach to the tachometer input.");
+        errno = ENOENT;
+        return -1;
+    }
+
+    snprintf(file, sizeof(file), "%s/fan1_input", fan_hwmon_dir);
+    return open(file, O_RDONLY | O_CLOEXEC);
+}
+
+/* wait for the fan to settle at the current duty and return its speed */
+int read_steady_rpm(int fd)
+{
+    long long rpm = 0;
+    long long last_rpm = -1;
+
+    sleep(calibration_settle);
+    for (int i = 0; i < 20; i++)
+    {
+        if (read_fd_value(fd, &rpm) != 0)
+        {
+            return -1;
+        }
+
+        if (last_rpm >= 0 && llabs(rpm - last_rpm) * 100 <= last_rpm * 3)
+        {
+            break;
+        }
+
+        last_rpm = rpm;
+        usleep(500000);
+    }
+
+    return (int)rpm;
+}
+
+int save_calibration()
+{
+    struct fan_calibration_struct *cal = &fan_calibration;
+    FIXED_STORAGE char buff[MAX_STATE_FILE_SIZE];
+    jsonWriter_t writer;
+
+    json_writerInit(&writer, buff, sizeof(buff), true);
+    json_writeObjOpen(&writer, NULL);
+    json_writeInteger(&writer, "start-duty", cal->start_duty);
+    json_writeInteger(&writer, "stall-duty", cal->stall_duty);
+    json_writeInteger(&writer, "max-rpm", cal->max_rpm);
+    json_writeArrOpen(&writer, "curve");
+    for (int i = 0; i < cal->count; i++)
+    {
+        json_writeObjOpen(&writer, NULL);
+        json_writeInteger(&writer, "duty", cal->duty[i]);
+        json_writeInteger(&writer, "rpm", cal->rpm[i]);
+        json_writeObjClose(&writer);
+    }
+    json_writeArrClose(&writer);
+    json_writeObjClose(&writer);
+
+    int len = json_writerEnd(&writer);
+    if (len < 0 || write_state_file(calibration_file, buff, len) != 0)
+    {
+        tlog(TLOG_ERROR, "Failed to write calibration file %s, %s", calibration_file, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int load_calibration()
+{
+    struct fan_calibration_struct *cal = &fan_calibration;
+    FIXED_STORAGE char str[MAX_STATE_FILE_SIZE];
+    enum
+    {
+        MAX_FIELDS = 128
+    };
+    FIXED_STORAGE json_t pool[MAX_FIELDS];
+    int fd = open(calibration_file, O_RDONLY | O_CLOEXEC);
+    int len = 0;
+
+    memset(cal, 0, sizeof(*cal));
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    memset(str, 0, sizeof(str));
+    len = read(fd, str, sizeof(str) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return -1;
+    }
+
+    json_t const *parent = json_create(str, pool, MAX_FIELDS);
+    if (parent == NULL)
+    {
+        tlog(TLOG_ERROR, "Invalid calibration file %s.", calibration_file);
+        return -1;
+    }
+
+    cal->start_duty = (int)json_get_number(parent, "start-duty");
+    cal->stall_duty = (int)json_get_number(parent, "stall-duty");
+    cal->max_rpm = (int)json_get_number(parent, "max-rpm");
+
+    json_t const *curve = json_getProperty(parent, "curve");
+    if (curve == NULL || json_getType(curve) != JSON_ARRAY)
+    {
+        tlog(TLOG_ERROR, "Invalid calibration file %s.", calibration_file);
+        return -1;
+    }
+
+    json_t const *point;
+    for (point = json_getChild(curve); point != 0 && cal->count < MAX_CALIBRATION_POINTS; point = json_getSibling(point))
+    {
+        cal->duty[cal->count] = (int)json_get_number(point, "duty");
+        cal->rpm[cal->count] = (int)json_get_number(point, "rpm");
+        cal->count++;
+    }
+
+    if (cal->count < 2 || cal->max_rpm <= 0)
+    {
+        tlog(TLOG_ERROR, "Calibration file %s has no usable curve.", calibration_file);
+        memset(cal, 0, sizeof(*cal));
+        return -1;
+    }
+
+    cal->valid = 1;
+    return 0;
+}
+
+int characterize_fan()
+{
+    struct fan_calibration_struct *cal = &fan_calibration;
+    int rpm_down[MAX_CALIBRATION_POINTS];
+    int fd = open_fan_tach();
+    int points = 100 / CALIBRATION_STEP + 1;
+
+    if (fd < 0)
+    {
+        tlog(TLOG_ERROR, "Failed to open fan tachometer, %s", strerror(errno));
+        return -1;
+    }
+
+    memset(cal, 0, sizeof(*cal));
+    cal->start_duty = -1;
+    cal->stall_duty = -1;
+
+    /* sweep down from full speed to find where the fan stalls */
+    for (int i = points - 1; i >= 0; i--)
+    {
+        int duty = i * CALIBRATION_STEP;
+        if (write_duty(duty * duty_full_scale() / 100) != 0)
+        {
+            tlog(TLOG_ERROR, "Failed to set duty %d%%, %s", duty, strerror(errno));
+            goto errout;
+        }
+
+        rpm_down[i] = read_steady_rpm(fd);
+        if (rpm_down[i] < 0)
+        {
+            tlog(TLOG_ERROR, "Failed to read fan speed, %s", strerror(errno));
+            goto errout;
+        }
+
+        tlog(TLOG_INFO, "down: duty %3d%%, rpm %d", duty, rpm_down[i]);
+        if (rpm_down[i] > 0)
+        {
+            cal->stall_duty = duty;
+        }
+    }
+
+    /* and back up from standstill to find where it starts */
+    for (int i = 0; i < points; i++)
+    {
+        int duty = i * CALIBRATION_STEP;
+        if (write_duty(duty * duty_full_scale() / 100) != 0)
+        {
+            tlog(TLOG_ERROR, "Failed to set duty %d%%, %s", duty, strerror(errno));
+            goto errout;
+        }
+
+        int rpm = read_steady_rpm(fd);
+        tlog(TLOG_INFO, "up:   duty %3d%%, rpm %d", duty, rpm);
+        if (rpm > 0)
+        {
+            cal->start_duty = duty;
+            break;
+        }
+    }
+
+    if (cal->stall_duty < 0 || cal->start_duty < 0)
+    {
+        tlog(TLOG_ERROR, "The fan never turned, is the tachometer connected?");
+        goto errout;
+    }
+
+    /* keep the spinning part of the curve, made monotonic, from a standstill point unless the fan never stops */
+    cal->count = 0;
+    if (cal->stall_duty > 0)
+    {
+        cal->duty[0] = 0;
+        cal->rpm[0] = 0;
+        cal->count = 1;
+    }
+
+    for (int i = cal->stall_duty / CALIBRATION_STEP; i < points && cal->count < MAX_CALIBRATION_POINTS; i++)
+    {
+        int rpm = rpm_down[i];
+        if (cal->count > 0 && rpm < cal->rpm[cal->count - 1])
+        {
+            rpm = cal->rpm[cal->count - 1];
+        }
+
+        cal->duty[cal->count] = i * CALIBRATION_STEP;
+        cal->rpm[cal->count] = rpm;
+        cal->count++;
+        cal->max_rpm = rpm;
+    }
+
+    close(fd);
+    write_speed(temp_map_size - 1);
+    tlog(TLOG_NOTICE, "fan starts at %d%%, stalls below %d%%, max %d rpm", cal->start_duty, cal->stall_duty, cal->max_rpm);
+    return save_calibration();
+
+errout:
+    close(fd);
+    write_speed(temp_map_size - 1);
+    return -1;
+}
+
+void update_temp_map()
+{
+    for (int i = 0; i < temp_map_size; i++)
+    {
+#ifdef FAN_CONTROL_EMBEDDED_CONF
+        /* the duty scaled at build time still holds unless calibration or auto-tune changed the curve */
+        if (!fan_calibration.valid && temp_map[i].percent == embedded_temp_map[i].percent)
+        {
+            temp_map[i].duty = embedded_duty[fan_mode == 1][i];
+            continue;
+        }
+#endif
+        temp_map[i].duty = duty_from_percent(temp_map[i].percent);
+    }
+}
+
+int create_pid_file(const char *pid_file)
+{
+    int fd = 0;
     int flags = 0;
     char buff[TMP_BUFF_LEN_32];
 
-    /*  create pid file, and lock this file */
-    fd = open(pid_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (fd == -1)
+    /*  create pid file, and lock this file */
+    fd = open(pid_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        tlog(TLOG_ERROR, "create pid file failed, %s", strerror(errno));
+        return -1;
+    }
+
+    flags = fcntl(fd, F_GETFD);
+    if (flags < 0)
+    {
+        tlog(TLOG_ERROR, "Could not get flags for PID file %s", pid_file);
+        goto errout;
+    }
+
+    flags |= FD_CLOEXEC;
+    if (fcntl(fd, F_SETFD, flags) == -1)
+    {
+        tlog(TLOG_ERROR, "Could not set flags for PID file %s", pid_file);
+        goto errout;
+    }
+
+    if (lockf(fd, F_TLOCK, 0) < 0)
+    {
+        tlog(TLOG_ERROR, "Server is already running.");
+        goto errout;
+    }
+
+    snprintf(buff, TMP_BUFF_LEN_32, "%d\n", getpid());
+
+    if (write(fd, buff, strnlen(buff, TMP_BUFF_LEN_32)) < 0)
+    {
+        tlog(TLOG_ERROR, "write pid to file failed, %s.", strerror(errno));
+        goto errout;
+    }
+
+    if (pidfile_fd > 0)
+    {
+        close(pidfile_fd);
+    }
+
+    pidfile_fd = fd;
+
+    return 0;
+errout:
+    if (fd > 0)
+    {
+        close(fd);
+    }
+    return -1;
+}
+
+int parser_auto_tune_json(json_t const *obj)
+{
+    json_t const *field = conf_get_property(obj, "mode");
+    if (field != NULL)
+    {
+        const char *mode = json_getValue(field);
+        if (json_getType(field) != JSON_TEXT)
+        {
+            tlog(TLOG_ERROR, "Invalid auto-tune mode field.");
+            return -1;
+        }
+
+        if (strcmp(mode, "off") == 0)
+        {
+            auto_tune_mode = AUTO_TUNE_OFF;
+        }
+        else if (strcmp(mode, "propose") == 0)
+        {
+            auto_tune_mode = AUTO_TUNE_PROPOSE;
+        }
+        else if (strcmp(mode, "apply") == 0)
+        {
+            auto_tune_mode = AUTO_TUNE_APPLY;
+        }
+        else
+        {
+            tlog(TLOG_ERROR, "Invalid auto-tune mode %s.", mode);
+            return -1;
+        }
+    }
+
+    field = conf_get_property(obj, "ceiling");
+    if (field != NULL)
+    {
+        if (json_getType(field) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid auto-tune ceiling field.");
+            return -1;
+        }
+
+        auto_tune_ceiling = json_getInteger(field);
+    }
+
+    field = conf_get_property(obj, "ambient");
+    if (field != NULL)
+    {
+        if (json_getType(field) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid auto-tune ambient field.");
+            return -1;
+        }
+
+        auto_tune_ambient = json_getInteger(field);
+    }
+
+    field = conf_get_property(obj, "interval");
+    if (field != NULL)
+    {
+        if (json_getType(field) != JSON_INTEGER || json_getInteger(field) <= 0)
+        {
+            tlog(TLOG_ERROR, "Invalid auto-tune interval field.");
+            return -1;
+        }
+
+        auto_tune_interval = json_getInteger(field);
+    }
+
+    field = conf_get_property(obj, "state-file");
+    if (field != NULL)
+    {
+        if (json_getType(field) != JSON_TEXT)
+        {
+            tlog(TLOG_ERROR, "Invalid auto-tune state-file field.");
+            return -1;
+        }
+
+        strncpy(auto_tune_file, json_getValue(field), sizeof(auto_tune_file) - 1);
+    }
+
+    if (auto_tune_ceiling <= auto_tune_ambient)
+    {
+        tlog(TLOG_ERROR, "auto-tune ceiling must be above ambient.");
+        return -1;
+    }
+
+    return 0;
+}
+
+int parser_log_json(json_t const *obj)
+{
+    json_t const *field = conf_get_property(obj, "level");
+    if (field != NULL)
+    {
+        if (json_getType(field) != JSON_TEXT || tlog_level_from_name(json_getValue(field)) < 0)
+        {
+            tlog(TLOG_ERROR, "Invalid log level field.");
+            return -1;
+        }
+
+        log_level = tlog_level_from_name(json_getValue(field));
+    }
+
+    field = conf_get_property(obj, "output");
+    if (field != NULL)
+    {
+        const char *output = json_getValue(field);
+        if (json_getType(field) != JSON_TEXT)
+        {
+            tlog(TLOG_ERROR, "Invalid log output field.");
+            return -1;
+        }
+
+        if (strcmp(output, "console") == 0)
+        {
+            log_output = TLOG_OUTPUT_CONSOLE;
+        }
+        else if (strcmp(output, "syslog") == 0)
+        {
+            log_output = TLOG_OUTPUT_SYSLOG;
+        }
+        else if (strcmp(output, "file") == 0)
+        {
+            log_output = TLOG_OUTPUT_FILE;
+        }
+        else
+        {
+            tlog(TLOG_ERROR, "Invalid log output %s.", output);
+            return -1;
+        }
+    }
+
+    field = conf_get_property(obj, "file");
+    if (field != NULL)
+    {
+        if (json_getType(field) != JSON_TEXT)
+        {
+            tlog(TLOG_ERROR, "Invalid log file field.");
+            return -1;
+        }
+
+        strncpy(log_file, json_getValue(field), sizeof(log_file) - 1);
+    }
+
+    return 0;
+}
+
+int parser_mpc_json(json_t const *obj)
+{
+    const char *keys[] = {"horizon", "ceiling", "ambient", "budget"};
+    int *values[] = {&mpc_horizon, &mpc_ceiling, &mpc_ambient, &mpc_budget};
+
+    for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        json_t const *field = conf_get_property(obj, keys[i]);
+        if (field == NULL)
+        {
+            continue;
+        }
+
+        if (json_getType(field) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid mpc %s field.", keys[i]);
+            return -1;
+        }
+
+        *values[i] = json_getInteger(field);
+    }
+
+    if (mpc_horizon <= 0 || mpc_budget <= 0 || mpc_ceiling <= mpc_ambient)
+    {
+        tlog(TLOG_ERROR, "Invalid mpc settings.");
+        return -1;
+    }
+
+    return 0;
+}
+
+int parser_passive_json(json_t const *obj)
+{
+    const char *keys[] = {"ceiling", "hysteresis", "step", "floor"};
+    int *values[] = {&passive_ceiling, &passive_hysteresis, &passive_step, &passive_floor};
+
+    for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        json_t const *field = conf_get_property(obj, keys[i]);
+        if (field == NULL)
+        {
+            continue;
+        }
+
+        if (json_getType(field) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid passive %s field.", keys[i]);
+            return -1;
+        }
+
+        *values[i] = json_getInteger(field);
+    }
+
+    if (passive_ceiling < 0 || passive_hysteresis < 1 || passive_step < 1 || passive_step > 100 || passive_floor < 0 ||
+        passive_floor > 100)
+    {
+        tlog(TLOG_ERROR, "Invalid passive settings.");
+        return -1;
+    }
+
+    return 0;
+}
+
+int parser_offload_json(json_t const *obj)
+{
+    const char *mode = NULL;
+    const char *governor = NULL;
+
+    if (conf_get_text(obj, "offload", "mode", &mode) != 0 || conf_get_text(obj, "offload", "governor", &governor) != 0)
+    {
+        return -1;
+    }
+
+    if (mode != NULL)
+    {
+        if (strcmp(mode, "off") == 0)
+        {
+            offload_mode = OFFLOAD_OFF;
+        }
+        else if (strcmp(mode, "exit") == 0)
+        {
+            offload_mode = OFFLOAD_EXIT;
+        }
+        else if (strcmp(mode, "idle") == 0)
+        {
+            offload_mode = OFFLOAD_IDLE;
+        }
+        else
+        {
+            tlog(TLOG_ERROR, "Invalid offload mode %s.", mode);
+            return -1;
+        }
+    }
+
+    if (governor != NULL)
+    {
+        if (strcmp(governor, "step_wise") != 0 && strcmp(governor, "fair_share") != 0)
+        {
+            tlog(TLOG_ERROR, "Invalid offload governor %s, use step_wise or fair_share.", governor);
+            return -1;
+        }
+        strncpy(offload_governor, governor, sizeof(offload_governor) - 1);
+    }
+
+    json_t const *hystfield = conf_get_property(obj, "hysteresis");
+    if (hystfield != NULL)
+    {
+        if (json_getType(hystfield) != JSON_INTEGER || json_getInteger(hystfield) < 0)
+        {
+            tlog(TLOG_ERROR, "Invalid offload hysteresis field.");
+            return -1;
+        }
+        offload_hysteresis = json_getInteger(hystfield);
+    }
+
+    return 0;
+}
+
+int parser_efficiency_json(json_t const *obj)
+{
+    const char *keys[] = {"ambient", "half-life", "drift", "warmup"};
+    int *values[] = {&efficiency_ambient, &efficiency_half_life, &efficiency_drift, &efficiency_warmup};
+
+    for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        json_t const *field = conf_get_property(obj, keys[i]);
+        if (field == NULL)
+        {
+            continue;
+        }
+
+        if (json_getType(field) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid efficiency %s field.", keys[i]);
+            return -1;
+        }
+
+        *values[i] = json_getInteger(field);
+    }
+
+    if (efficiency_half_life < 1 || efficiency_drift < 1 || efficiency_warmup < 0)
+    {
+        tlog(TLOG_ERROR, "Invalid efficiency settings.");
+        return -1;
+    }
+
+    const char *file = NULL;
+    if (conf_get_text(obj, "efficiency", "state-file", &file) != 0)
+    {
+        return -1;
+    }
+
+    if (file != NULL)
+    {
+        strncpy(efficiency_file, file, sizeof(efficiency_file) - 1);
+    }
+
+    efficiency_enable = 1;
+    return 0;
+}
+
+int parser_failsafe_json(json_t const *obj)
+{
+    const char *keys[] = {"temp-min", "temp-max", "retries", "safe-duty", "write-faults"};
+    int *values[] = {&failsafe_temp_min, &failsafe_temp_max, &failsafe_retries, &failsafe_safe_duty, &failsafe_write_faults};
+
+    for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        json_t const *field = conf_get_property(obj, keys[i]);
+        if (field == NULL)
+        {
+            continue;
+        }
+
+        if (json_getType(field) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid failsafe %s field.", keys[i]);
+            return -1;
+        }
+
+        *values[i] = json_getInteger(field);
+    }
+
+    if (failsafe_temp_min >= failsafe_temp_max || failsafe_retries < 0 || failsafe_safe_duty < 0 || failsafe_safe_duty > 100 ||
+        failsafe_write_faults < 1)
+    {
+        tlog(TLOG_ERROR, "Invalid failsafe settings.");
+        return -1;
+    }
+
+    json_t const *fallback = conf_get_property(obj, "fallback");
+    if (fallback != NULL)
+    {
+        if (json_getType(fallback) != JSON_ARRAY)
+        {
+            tlog(TLOG_ERROR, "Invalid failsafe fallback field.");
+            return -1;
+        }
+
+        fallback_sensor_num = 0;
+        json_t const *path;
+        for (path = json_getChild(fallback); path != 0; path = json_getSibling(path))
+        {
+            if (json_getType(path) != JSON_TEXT || fallback_sensor_num >= MAX_FALLBACK_SENSORS)
+            {
+                tlog(TLOG_ERROR, "Invalid failsafe fallback sensor, at most %d paths.", MAX_FALLBACK_SENSORS);
+                return -1;
+            }
+
+            strncpy(fallback_sensor_path[fallback_sensor_num], json_getValue(path), sizeof(fallback_sensor_path[0]) - 1);
+            fallback_sensor_num++;
+        }
+    }
+
+    return 0;
+}
+
+int parser_temp_map_json(json_t const *temp_map_array, struct temp_map_struct *map, int *map_size)
+{
+    int temp_obj_size = 0;
+    json_t const *temp_obj;
+    for (temp_obj = json_getChild(temp_map_array); temp_obj != 0; temp_obj = json_getSibling(temp_obj))
+    {
+        temp_obj_size++;
+    }
+
+    if (temp_obj_size > MAX_TEMP_MAP_SIZE)
+    {
+        tlog(TLOG_ERROR, "Too many temp-map entries, max %d.", MAX_TEMP_MAP_SIZE);
+        return -1;
+    }
+
+    memset(map, 0, sizeof(*map) * MAX_TEMP_MAP_SIZE);
+
+    int id = 0;
+    for (temp_obj = json_getChild(temp_map_array); temp_obj != 0; temp_obj = json_getSibling(temp_obj))
+    {
+        if (JSON_OBJ != json_getType(temp_obj))
+        {
+            continue;
+        }
+
+        json_t const *json_temp = conf_get_property(temp_obj, "temp");
+        json_t const *json_duty = conf_get_property(temp_obj, "duty");
+        json_t const *json_duration = conf_get_property(temp_obj, "duration");
+
+        if (json_getType(json_temp) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid temp field.");
+            return -1;
+        }
+
+        if (json_getType(json_duty) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid duty field.");
+            return -1;
+        }
+
+        if (json_getType(json_duration) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid duration field.");
+            return -1;
+        }
+
+        int temp = json_getInteger(json_temp);
+        int duty = json_getInteger(json_duty);
+        int duration = json_getInteger(json_duration);
+
+        map[id].speed = id;
+        map[id].temp = temp;
+        map[id].duty = duty * pwm_period / 100;
+        map[id].duration = duration;
+        map[id].percent = duty;
+        id++;
+    }
+
+    *map_size = temp_obj_size;
+    return 0;
+}
+
+int parser_sensor_json(json_t const *obj, struct sensor_struct *s)
+{
+    json_t const *typefield = conf_get_property(obj, "type");
+    const char *type = "thermal";
+    if (typefield != NULL)
+    {
+        if (json_getType(typefield) != JSON_TEXT)
+        {
+            tlog(TLOG_ERROR, "Invalid sensor type field.");
+            return -1;
+        }
+        type = json_getValue(typefield);
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->scale = 1;
+    s->fd = -1;
+    s->id = -1;
+    if (strcmp(type, "thermal") == 0)
+    {
+        s->type = SENSOR_THERMAL;
+        json_t const *zonefield = conf_get_property(obj, "zone");
+        if (zonefield != NULL && json_getType(zonefield) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid sensor zone field.");
+            return -1;
+        }
+        int zone = zonefield ? json_getInteger(zonefield) : 0;
+        snprintf(s->path, sizeof(s->path), "%s/thermal_zone%d/temp", thermal_zone_path, zone);
+    }
+    else if (strcmp(type, "hwmon") == 0)
+    {
+        char dir[768];
+        const char *name = NULL;
+        const char *input = NULL;
+        s->type = SENSOR_HWMON;
+        if (conf_get_text(obj, "sensor", "name", &name) != 0 || conf_get_text(obj, "sensor", "input", &input) != 0)
+        {
+            return -1;
+        }
+
+        if (name == NULL)
+        {
+            tlog(TLOG_ERROR, "Missing hwmon sensor name field.");
+            return -1;
+        }
+        strncpy(s->name, name, sizeof(s->name) - 1);
+
+        if (input == NULL)
+        {
+            input = "temp1_input";
+        }
+
+        if (strncmp(input, "temp", 4) != 0 || strchr(input, '/') != NULL)
+        {
+            tlog(TLOG_ERROR, "Invalid hwmon sensor input %s.", input);
+            return -1;
+        }
+
+        /* a missing device only fails when the sensors are opened, like any other unreadable source */
+        if (find_hwmon_by_name(name, dir, sizeof(dir)) != 0)
+        {
+            tlog(TLOG_WARN, "hwmon device %s not found.", name);
+            snprintf(dir, sizeof(dir), "%s/%s", hwmon_path, name);
+        }
+        snprintf(s->path, sizeof(s->path), "%s/%s", dir, input);
+    }
+    else if (strcmp(type, "file") == 0)
+    {
+        const char *path = NULL;
+        s->type = SENSOR_FILE;
+        if (conf_get_text(obj, "sensor", "path", &path) != 0)
+        {
+            return -1;
+        }
+
+        if (path == NULL)
+        {
+            tlog(TLOG_ERROR, "Missing file sensor path field.");
+            return -1;
+        }
+        strncpy(s->path, path, sizeof(s->path) - 1);
+
+        json_t const *scalefield = conf_get_property(obj, "scale");
+        if (scalefield != NULL)
+        {
+            if (json_getType(scalefield) != JSON_REAL && json_getType(scalefield) != JSON_INTEGER)
+            {
+                tlog(TLOG_ERROR, "Invalid sensor scale field.");
+                return -1;
+            }
+            s->scale = json_get_number(obj, "scale");
+        }
+    }
+    else
+    {
+        tlog(TLOG_ERROR, "Invalid sensor type %s.", type);
+        return -1;
+    }
+
+    json_t const *offsetfield = conf_get_property(obj, "offset");
+    if (offsetfield != NULL)
+    {
+        if (json_getType(offsetfield) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid sensor offset field.");
+            return -1;
+        }
+        s->offset = json_getInteger(offsetfield);
+    }
+
+    json_t const *intervalfield = conf_get_property(obj, "interval");
+    if (intervalfield != NULL)
+    {
+        if (json_getType(intervalfield) != JSON_INTEGER || json_getInteger(intervalfield) < 0)
+        {
+            tlog(TLOG_ERROR, "Invalid sensor interval field.");
+            return -1;
+        }
+        s->interval_ms = json_getInteger(intervalfield);
+    }
+
+    return 0;
+}
+
+int parser_sensors_json(json_t const *sensor_array)
+{
+    json_t const *sensor_obj;
+
+    sensor_num = 0;
+    for (sensor_obj = json_getChild(sensor_array); sensor_obj != 0; sensor_obj = json_getSibling(sensor_obj))
+    {
+        if (sensor_num >= MAX_SENSORS)
+        {
+            tlog(TLOG_ERROR, "Too many sensors, max %d.", MAX_SENSORS);
+            return -1;
+        }
+
+        if (json_getType(sensor_obj) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid sensor.");
+            return -1;
+        }
+
+        if (parser_sensor_json(sensor_obj, &sensor[sensor_num]) != 0)
+        {
+            return -1;
+        }
+
+        sensor_num++;
+    }
+
+    return 0;
+}
+
+int parser_shadow_json(json_t const *shadow_array)
+{
+    json_t const *shadow_obj;
+
+    shadow_curve_num = 0;
+    for (shadow_obj = json_getChild(shadow_array); shadow_obj != 0; shadow_obj = json_getSibling(shadow_obj))
+    {
+        if (shadow_curve_num >= MAX_SHADOW_CURVES)
+        {
+            tlog(TLOG_ERROR, "Too many shadow curves, max %d.", MAX_SHADOW_CURVES);
+            return -1;
+        }
+
+        struct shadow_curve_struct *shadow = &shadow_curve[shadow_curve_num];
+        memset(shadow, 0, sizeof(*shadow));
+        snprintf(shadow->name, sizeof(shadow->name), "shadow%d", shadow_curve_num);
+        shadow->state.last_speed = -1;
+        shadow->state.last_temperature = -1;
+        shadow->stats.last_speed = -1;
+
+        if (json_getType(shadow_obj) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid shadow curve.");
+            return -1;
+        }
+
+        json_t const *namefield = conf_get_property(shadow_obj, "name");
+        if (namefield != NULL)
+        {
+            if (json_getType(namefield) != JSON_TEXT)
+            {
+                tlog(TLOG_ERROR, "Invalid shadow name field.");
+                return -1;
+            }
+
+            strncpy(shadow->name, json_getValue(namefield), sizeof(shadow->name) - 1);
+        }
+
+        json_t const *temp_map_array = conf_get_property(shadow_obj, "temp-map");
+        if (temp_map_array == NULL || json_getType(temp_map_array) != JSON_ARRAY)
+        {
+            tlog(TLOG_ERROR, "Invalid temp-map field of shadow curve %s.", shadow->name);
+            return -1;
+        }
+
+        if (parser_temp_map_json(temp_map_array, shadow->map, &shadow->map_size) != 0)
+        {
+            return -1;
+        }
+
+        if (shadow->map_size <= 0)
+        {
+            tlog(TLOG_ERROR, "Empty temp-map of shadow curve %s.", shadow->name);
+            return -1;
+        }
+
+        shadow_curve_num++;
+    }
+
+    return 0;
+}
+
+int parser_lease_json(json_t const *obj)
+{
+    const char *keys[] = {"max", "max-duration"};
+    int *values[] = {&lease_max, &lease_max_duration};
+
+    for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        json_t const *field = conf_get_property(obj, keys[i]);
+        if (field == NULL)
+        {
+            continue;
+        }
+
+        if (json_getType(field) != JSON_INTEGER || json_getInteger(field) < 1)
+        {
+            tlog(TLOG_ERROR, "Invalid lease %s field.", keys[i]);
+            return -1;
+        }
+
+        *values[i] = json_getInteger(field);
+    }
+
+    if (lease_max > MAX_LEASES)
+    {
+        tlog(TLOG_ERROR, "Too many leases, max %d.", MAX_LEASES);
+        return -1;
+    }
+
+    const char *file = NULL;
+    if (conf_get_text(obj, "lease", "socket", &file) != 0)
+    {
+        return -1;
+    }
+
+    if (file != NULL)
+    {
+        if (strlen(file) >= sizeof(lease_socket))
+        {
+            tlog(TLOG_ERROR, "Lease socket path %s is too long.", file);
+            return -1;
+        }
+        strncpy(lease_socket, file, sizeof(lease_socket) - 1);
+    }
+
+    lease_enable = 1;
+    return 0;
+}
+
+int parser_dither_json(json_t const *obj)
+{
+    json_t const *field = conf_get_property(obj, "interval");
+    if (field != NULL)
+    {
+        if (json_getType(field) != JSON_INTEGER || json_getInteger(field) < 1)
+        {
+            tlog(TLOG_ERROR, "Invalid dither interval field.");
+            return -1;
+        }
+
+        dither_interval = json_getInteger(field);
+    }
+
+    dither_enable = 1;
+    return 0;
+}
+
+int parser_watchdog_json(json_t const *obj)
+{
+    json_t const *field = conf_get_property(obj, "misses");
+    if (field != NULL)
+    {
+        if (json_getType(field) != JSON_INTEGER || json_getInteger(field) < 0)
+        {
+            tlog(TLOG_ERROR, "Invalid watchdog misses field.");
+            return -1;
+        }
+
+        watchdog_misses = json_getInteger(field);
+    }
+
+    return 0;
+}
+
+int parser_profile_json(json_t const *obj, struct profile_struct *p)
+{
+    const char *keys[] = {"floor", "temp-offset", "revert-delay"};
+    int *values[] = {&p->floor, &p->temp_offset, &p->revert_delay};
+
+    const char *name = NULL;
+    const char *cgroup = NULL;
+    if (conf_get_text(obj, "profile", "name", &name) != 0 || conf_get_text(obj, "profile", "cgroup", &cgroup) != 0)
+    {
+        return -1;
+    }
+
+    if (cgroup == NULL)
+    {
+        tlog(TLOG_ERROR, "Missing cgroup field of profile.");
+        return -1;
+    }
+
+    strncpy(p->name, name != NULL ? name : cgroup, sizeof(p->name) - 1);
+    if (cgroup[0] == '/')
+    {
+        strncpy(p->cgroup, cgroup, sizeof(p->cgroup) - 1);
+    }
+    else
+    {
+        snprintf(p->cgroup, sizeof(p->cgroup), "%s%s/%s", sysfs_root, CGROUP_PATH, cgroup);
+    }
+
+    for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        json_t const *field = conf_get_property(obj, keys[i]);
+        if (field == NULL)
+        {
+            continue;
+        }
+
+        if (json_getType(field) != JSON_INTEGER || json_getInteger(field) < 0)
+        {
+            tlog(TLOG_ERROR, "Invalid %s field of profile %s.", keys[i], p->name);
+            return -1;
+        }
+
+        *values[i] = json_getInteger(field);
+    }
+
+    if (p->floor > 100)
+    {
+        tlog(TLOG_ERROR, "Invalid floor field of profile %s.", p->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+int parser_profiles_json(json_t const *profile_array)
+{
+    json_t const *profile_obj;
+
+    profile_num = 0;
+    for (profile_obj = json_getChild(profile_array); profile_obj != 0; profile_obj = json_getSibling(profile_obj))
+    {
+        if (profile_num >= MAX_PROFILES)
+        {
+            tlog(TLOG_ERROR, "Too many profiles, max %d.", MAX_PROFILES);
+            return -1;
+        }
+
+        if (json_getType(profile_obj) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid profile.");
+            return -1;
+        }
+
+        struct profile_struct *p = &profile[profile_num];
+        memset(p, 0, sizeof(*p));
+        p->revert_delay = 60;
+        p->wd_events = -1;
+        p->wd_parent = -1;
+        if (parser_profile_json(profile_obj, p) != 0)
+        {
+            return -1;
+        }
+
+        profile_num++;
+    }
+
+    return 0;
+}
+
+int parser_conf_json(const char *data)
+{
+    FIXED_STORAGE char str[MAX_CONF_FILE_SIZE];
+    struct temp_map_struct temp_map_buff[MAX_TEMP_MAP_SIZE];
+    enum
+    {
+        MAX_FIELDS = 1024
+    };
+    FIXED_STORAGE json_t pool[MAX_FIELDS];
+
+    strncpy(str, data, MAX_CONF_FILE_SIZE - 1);
+    json_t const *parent = json_createIndexed(str, pool, MAX_FIELDS, &conf_json_index);
+    if (parent == NULL)
+    {
+        tlog(TLOG_ERROR, "Failed to parse json file.");
+        goto errout;
+    }
+
+    json_t const *pwmchipfield = conf_get_property(parent, "pwmchip");
+    if (pwmchipfield != NULL)
+    {
+        if (json_getType(pwmchipfield) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid pwmchip field.");
+            goto errout;
+        }
+
+        pwmchip_id = json_getInteger(pwmchipfield);
+    }
+
+    json_t const *gpiofield = conf_get_property(parent, "gpio");
+    if (gpiofield != NULL)
+    {
+        if (json_getType(gpiofield) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid gpio field.");
+            goto errout;
+        }
+
+        pwmchip_gpio_id = json_getInteger(gpiofield);
+    }
+
+    json_t const *periodfield = conf_get_property(parent, "pwm-period");
+    if (periodfield != NULL)
+    {
+        if (json_getType(periodfield) != JSON_INTEGER)
+        {
+            tlog(TLOG_ERROR, "Invalid period field.");
+            goto errout;
+        }
+
+        pwm_period = json_getInteger(periodfield);
+    }
+
+    json_t const *throttlefield = conf_get_property(parent, "throttle-detect");
+    if (throttlefield != NULL)
+    {
+        if (json_getType(throttlefield) != JSON_BOOLEAN)
+        {
+            tlog(TLOG_ERROR, "Invalid throttle-detect field.");
+            goto errout;
+        }
+
+        throttle_detect = json_getBoolean(throttlefield);
+    }
+
+    json_t const *tachfield = conf_get_property(parent, "fan-tach");
+    if (tachfield != NULL)
+    {
+        if (json_getType(tachfield) != JSON_TEXT)
+        {
+            tlog(TLOG_ERROR, "Invalid fan-tach field.");
+            goto errout;
+        }
+
+        strncpy(fan_tach_path, json_getValue(tachfield), sizeof(fan_tach_path) - 1);
+    }
+
+    json_t const *calibrationfield = conf_get_property(parent, "calibration-file");
+    if (calibrationfield != NULL)
+    {
+        if (json_getType(calibrationfield) != JSON_TEXT)
+        {
+            tlog(TLOG_ERROR, "Invalid calibration-file field.");
+            goto errout;
+        }
+
+        strncpy(calibration_file, json_getValue(calibrationfield), sizeof(calibration_file) - 1);
+    }
+
+    json_t const *settlefield = conf_get_property(parent, "calibration-settle");
+    if (settlefield != NULL)
+    {
+        if (json_getType(settlefield) != JSON_INTEGER || json_getInteger(settlefield) < 1)
+        {
+            tlog(TLOG_ERROR, "Invalid calibration-settle field.");
+            goto errout;
+        }
+
+        calibration_settle = json_getInteger(settlefield);
+    }
+
+    json_t const *intervalfield = conf_get_property(parent, "interval");
+    if (intervalfield != NULL)
+    {
+        if (json_getType(intervalfield) != JSON_INTEGER || json_getInteger(intervalfield) < 10)
+        {
+            tlog(TLOG_ERROR, "Invalid interval field.");
+            goto errout;
+        }
+
+        loop_interval_ms = json_getInteger(intervalfield);
+    }
+
+    json_t const *handoverfield = conf_get_property(parent, "handover");
+    if (handoverfield != NULL)
+    {
+        json_t const *timeoutfield = json_getType(handoverfield) == JSON_OBJ ? conf_get_property(handoverfield, "timeout") : NULL;
+        const char *file = NULL;
+        if (json_getType(handoverfield) != JSON_OBJ || (timeoutfield != NULL && json_getType(timeoutfield) != JSON_INTEGER))
+        {
+            tlog(TLOG_ERROR, "Invalid handover field.");
+            goto errout;
+        }
+
+        if (conf_get_text(handoverfield, "handover", "state-file", &file) != 0)
+        {
+            goto errout;
+        }
+
+        if (timeoutfield != NULL)
+        {
+            handover_timeout = json_getInteger(timeoutfield);
+        }
+
+        if (file != NULL)
+        {
+            strncpy(handover_file, file, sizeof(handover_file) - 1);
+        }
+    }
+
+    json_t const *statusfield = conf_get_property(parent, "status-file");
+    if (statusfield != NULL)
+    {
+        if (json_getType(statusfield) != JSON_TEXT)
+        {
+            tlog(TLOG_ERROR, "Invalid status-file field.");
+            goto errout;
+        }
+
+        strncpy(status_file, json_getValue(statusfield), sizeof(status_file) - 1);
+    }
+
+    json_t const *iouringfield = conf_get_property(parent, "io-uring");
+    if (iouringfield != NULL)
+    {
+        if (json_getType(iouringfield) != JSON_BOOLEAN)
+        {
+            tlog(TLOG_ERROR, "Invalid io-uring field.");
+            goto errout;
+        }
+
+        use_io_uring = json_getBoolean(iouringfield);
+    }
+
+    json_t const *threadedfield = conf_get_property(parent, "threaded");
+    if (threadedfield != NULL)
+    {
+        if (json_getType(threadedfield) != JSON_BOOLEAN)
+        {
+            tlog(TLOG_ERROR, "Invalid threaded field.");
+            goto errout;
+        }
+
+        threaded = json_getBoolean(threadedfield);
+    }
+
+    json_t const *sensorsfield = conf_get_property(parent, "sensors");
+    if (sensorsfield != NULL)
+    {
+        if (json_getType(sensorsfield) != JSON_ARRAY)
+        {
+            tlog(TLOG_ERROR, "Invalid sensors field.");
+            goto errout;
+        }
+
+        if (parser_sensors_json(sensorsfield) != 0)
+        {
+            goto errout;
+        }
+    }
+
+    json_t const *shadowfield = conf_get_property(parent, "shadow");
+    if (shadowfield != NULL)
+    {
+        if (json_getType(shadowfield) != JSON_ARRAY)
+        {
+            tlog(TLOG_ERROR, "Invalid shadow field.");
+            goto errout;
+        }
+
+        if (parser_shadow_json(shadowfield) != 0)
+        {
+            goto errout;
+        }
+    }
+
+    json_t const *leasefield = conf_get_property(parent, "lease");
+    if (leasefield != NULL)
+    {
+        if (json_getType(leasefield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid lease field.");
+            goto errout;
+        }
+
+        if (parser_lease_json(leasefield) != 0)
+        {
+            goto errout;
+        }
+    }
+
+    json_t const *ditherfield = conf_get_property(parent, "dither");
+    if (ditherfield != NULL)
     {
-        fprintf(stderr, "create pid file failed, %s\n", strerror(errno));
-        return -1;
+        if (json_getType(ditherfield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid dither field.");
+            goto errout;
+        }
+
+        if (parser_dither_json(ditherfield) != 0)
+        {
+            goto errout;
+        }
     }
 
-    flags = fcntl(fd, F_GETFD);
-    if (flags < 0)
+    json_t const *watchdogfield = conf_get_property(parent, "watchdog");
+    if (watchdogfield != NULL)
     {
-        fprintf(stderr, "Could not get flags for PID file %s\n", pid_file);
-        goto errout;
+        if (json_getType(watchdogfield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid watchdog field.");
+            goto errout;
+        }
+
+        if (parser_watchdog_json(watchdogfield) != 0)
+        {
+            goto errout;
+        }
     }
 
-    flags |= FD_CLOEXEC;
-    if (fcntl(fd, F_SETFD, flags) == -1)
+    json_t const *profilesfield = conf_get_property(parent, "profiles");
+    if (profilesfield != NULL)
     {
-        fprintf(stderr, "Could not set flags for PID file %s\n", pid_file);
-        goto errout;
+        if (json_getType(profilesfield) != JSON_ARRAY)
+        {
+            tlog(TLOG_ERROR, "Invalid profiles field.");
+            goto errout;
+        }
+
+        if (parser_profiles_json(profilesfield) != 0)
+        {
+            goto errout;
+        }
     }
 
-    if (lockf(fd, F_TLOCK, 0) < 0)
+    json_t const *offloadfield = conf_get_property(parent, "offload");
+    if (offloadfield != NULL)
     {
-        fprintf(stderr, "Server is already running.\n");
-        goto errout;
+        if (json_getType(offloadfield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid offload field.");
+            goto errout;
+        }
+
+        if (parser_offload_json(offloadfield) != 0)
+        {
+            goto errout;
+        }
     }
 
-    snprintf(buff, TMP_BUFF_LEN_32, "%d\n", getpid());
+    json_t const *efficiencyfield = conf_get_property(parent, "efficiency");
+    if (efficiencyfield != NULL)
+    {
+        if (json_getType(efficiencyfield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid efficiency field.");
+            goto errout;
+        }
 
-    if (write(fd, buff, strnlen(buff, TMP_BUFF_LEN_32)) < 0)
+        if (parser_efficiency_json(efficiencyfield) != 0)
+        {
+            goto errout;
+        }
+    }
+
+    json_t const *passivefield = conf_get_property(parent, "passive");
+    if (passivefield != NULL)
     {
-        fprintf(stderr, "write pid to file failed, %s.\n", strerror(errno));
-        goto errout;
+        if (json_getType(passivefield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid passive field.");
+            goto errout;
+        }
+
+        if (parser_passive_json(passivefield) != 0)
+        {
+            goto errout;
+        }
     }
 
-    if (pidfile_fd > 0)
+    json_t const *failsafefield = conf_get_property(parent, "failsafe");
+    if (failsafefield != NULL)
     {
-        close(pidfile_fd);
+        if (json_getType(failsafefield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid failsafe field.");
+            goto errout;
+        }
+
+        if (parser_failsafe_json(failsafefield) != 0)
+        {
+            goto errout;
+        }
     }
 
-    pidfile_fd = fd;
+    json_t const *controlfield = conf_get_property(parent, "control");
+    if (controlfield != NULL)
+    {
+        if (json_getType(controlfield) != JSON_TEXT)
+        {
+            tlog(TLOG_ERROR, "Invalid control field.");
+            goto errout;
+        }
+
+        if (strcmp(json_getValue(controlfield), "curve") == 0)
+        {
+            control_mode = CONTROL_CURVE;
+        }
+        else if (strcmp(json_getValue(controlfield), "mpc") == 0)
+        {
+            control_mode = CONTROL_MPC;
+        }
+        else
+        {
+            tlog(TLOG_ERROR, "Invalid control %s.", json_getValue(controlfield));
+            goto errout;
+        }
+    }
+
+    json_t const *mpcfield = conf_get_property(parent, "mpc");
+    if (mpcfield != NULL)
+    {
+        if (json_getType(mpcfield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid mpc field.");
+            goto errout;
+        }
+
+        if (parser_mpc_json(mpcfield) != 0)
+        {
+            goto errout;
+        }
+    }
+
+    json_t const *logfield = conf_get_property(parent, "log");
+    if (logfield != NULL)
+    {
+        if (json_getType(logfield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid log field.");
+            goto errout;
+        }
+
+        if (parser_log_json(logfield) != 0)
+        {
+            goto errout;
+        }
+    }
+
+    json_t const *autotunefield = conf_get_property(parent, "auto-tune");
+    if (autotunefield != NULL)
+    {
+        if (json_getType(autotunefield) != JSON_OBJ)
+        {
+            tlog(TLOG_ERROR, "Invalid auto-tune field.");
+            goto errout;
+        }
+
+        if (parser_auto_tune_json(autotunefield) != 0)
+        {
+            goto errout;
+        }
+    }
+
+    json_t const *temp_map_array = conf_get_property(parent, "temp-map");
+    if (temp_map_array != NULL)
+    {
+        if (json_getType(temp_map_array) != JSON_ARRAY)
+        {
+            tlog(TLOG_ERROR, "Invalid temp-map field.");
+            goto errout;
+        }
+
+        int temp_obj_size = 0;
+        if (parser_temp_map_json(temp_map_array, temp_map_buff, &temp_obj_size) != 0)
+        {
+            goto errout;
+        }
+
+        if (temp_obj_size > 0)
+        {
+            memcpy(temp_map_storage, temp_map_buff, sizeof(temp_map_buff));
+            temp_map_size = temp_obj_size;
+            temp_map = temp_map_storage;
+        }
+    }
 
+    memset(&conf_json_index, 0, sizeof(conf_json_index));
     return 0;
+
 errout:
-    if (fd > 0)
+    memset(&conf_json_index, 0, sizeof(conf_json_index));
+    return -1;
+}
+
+int load_conf(const char *conf_file)
+{
+    int fd = -1;
+    FIXED_STORAGE char buff[MAX_CONF_FILE_SIZE];
+
+    fd = open(conf_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        tlog(TLOG_ERROR, "Failed to open config file, %s", strerror(errno));
+        return -1;
+    }
+
+    memset(buff, 0, MAX_CONF_FILE_SIZE);
+    int len = read(fd, buff, MAX_CONF_FILE_SIZE - 1);
+    if (len <= 0)
+    {
+        tlog(TLOG_ERROR, "Failed to read config file, %s", strerror(errno));
+        goto errout;
+    }
+
+    if (parser_conf_json(buff) < 0)
+    {
+        tlog(TLOG_ERROR, "Failed to parser config file.");
+        goto errout;
+    }
+
+    TRACE_PROBE2(config_load, conf_file, 0);
+    close(fd);
+    return 0;
+
+errout:
+    TRACE_PROBE2(config_load, conf_file, -1);
+    if (fd >= 0)
     {
         close(fd);
     }
+
     return -1;
 }
 
-int parser_conf_json(const char *data)
+#ifdef FAN_CONTROL_CONF_GEN
+void conf_gen_string(FILE *fp, const char *str)
 {
-    char str[MAX_CONF_FILE_SIZE];
-    struct temp_map_struct *temp_map_buff = NULL;
-    enum
+    fputc('"', fp);
+    for (; *str; str++)
     {
-        MAX_FIELDS = 1024
-    };
-    json_t pool[MAX_FIELDS];
+        if (*str == '"' || *str == '\\')
+        {
+            fprintf(fp, "\\%c", *str);
+        }
+        else if ((unsigned char)*str < ' ' || (unsigned char)*str > '~')
+        {
+            fprintf(fp, "\\%03o", (unsigned char)*str);
+        }
+        else
+        {
+            fputc(*str, fp);
+        }
+    }
+    fputc('"', fp);
+}
 
-    strncpy(str, data, MAX_CONF_FILE_SIZE - 1);
-    json_t const *parent = json_create(str, pool, MAX_FIELDS);
-    if (parent == NULL)
+void conf_gen_temp_map(FILE *fp, const struct temp_map_struct *map, int size)
+{
+    fprintf(fp, "{");
+    for (int i = 0; i < size; i++)
     {
-        printf("Failed to parse json file.\n");
-        goto errout;
+        fprintf(fp, "%s{%d, %d, %d, %d, %d}", i > 0 ? ", " : "", map[i].speed, map[i].temp, map[i].duty, map[i].duration,
+                map[i].percent);
     }
+    fprintf(fp, "}");
+}
 
-    json_t const *pwmchipfield = json_getProperty(parent, "pwmchip");
-    if (pwmchipfield != NULL)
+/* write the parsed config as constant tables for a FAN_CONTROL_EMBEDDED_CONF build */
+int conf_gen(const char *conf_file, const char *header_file)
+{
+    if (load_conf(conf_file) != 0)
     {
-        if (json_getType(pwmchipfield) != JSON_INTEGER)
+        return -1;
+    }
+
+    FILE *fp = fopen(header_file, "w");
+    if (fp == NULL)
+    {
+        tlog(TLOG_ERROR, "Failed to create %s, %s", header_file, strerror(errno));
+        return -1;
+    }
+
+    fprintf(fp, "/* generated from %s, do not edit */\n\n", conf_file);
+    fprintf(fp, "static const struct conf_int_value embedded_int[] = {\n");
+#define CONF_GEN_INT(var) fprintf(fp, "    {&" #var ", %d},\n", var);
+    CONF_INT_VARS(CONF_GEN_INT)
+    fprintf(fp, "};\n\nstatic const struct conf_str_value embedded_str[] = {\n");
+#define CONF_GEN_STR(var)                                                                                                \
+    fprintf(fp, "    {" #var ", sizeof(" #var "), ");                                                                     \
+    conf_gen_string(fp, var);                                                                                            \
+    fprintf(fp, "},\n");
+    CONF_STR_VARS(CONF_GEN_STR)
+
+    /* duty pre-scaled for the pwmchip period and for the 0-255 hwmon range */
+    fprintf(fp, "};\n\nstatic const int embedded_temp_map_size = %d;\n", temp_map_size);
+    fprintf(fp, "static const struct temp_map_struct embedded_temp_map[MAX_TEMP_MAP_SIZE] = ");
+    conf_gen_temp_map(fp, temp_map, temp_map_size);
+    fprintf(fp, ";\nstatic const int embedded_duty[2][MAX_TEMP_MAP_SIZE] = {{");
+    for (int mode = 0; mode < 2; mode++)
+    {
+        for (int i = 0; i < temp_map_size; i++)
         {
-            printf("Invalid pwmchip field.\n");
-            goto errout;
+            fprintf(fp, "%s%d", i > 0 ? ", " : "", temp_map[i].percent * (mode == 0 ? pwm_period : 255) / 100);
+        }
+        fprintf(fp, mode == 0 ? "}, {" : "}};\n");
+    }
+
+    fprintf(fp, "\nstatic const int embedded_sensor_num = %d;\n", sensor_num);
+    fprintf(fp, "static const struct sensor_struct embedded_sensor[MAX_SENSORS] = {\n");
+    for (int i = 0; i < sensor_num; i++)
+    {
+        fprintf(fp, "    {.type = %d, .path = ", sensor[i].type);
+        conf_gen_string(fp, sensor[i].path);
+        fprintf(fp, ", .name = ");
+        conf_gen_string(fp, sensor[i].name);
+        fprintf(fp, ", .scale = %.17g, .offset = %d, .interval_ms = %d, .fd = -1, .id = -1},\n", sensor[i].scale,
+                sensor[i].offset, sensor[i].interval_ms);
+    }
+
+    fprintf(fp, "};\n\nstatic const int embedded_fallback_sensor_num = %d;\n", fallback_sensor_num);
+    fprintf(fp, "static const char embedded_fallback_sensor_path[MAX_FALLBACK_SENSORS][1024] = {\n");
+    for (int i = 0; i < fallback_sensor_num; i++)
+    {
+        fprintf(fp, "    ");
+        conf_gen_string(fp, fallback_sensor_path[i]);
+        fprintf(fp, ",\n");
+    }
+
+    fprintf(fp, "};\n\nstatic const int embedded_shadow_curve_num = %d;\n", shadow_curve_num);
+    fprintf(fp, "static const struct shadow_curve_struct embedded_shadow_curve[MAX_SHADOW_CURVES] = {\n");
+    for (int i = 0; i < shadow_curve_num; i++)
+    {
+        fprintf(fp, "    {.name = ");
+        conf_gen_string(fp, shadow_curve[i].name);
+        fprintf(fp, ", .map = ");
+        conf_gen_temp_map(fp, shadow_curve[i].map, shadow_curve[i].map_size);
+        fprintf(fp, ", .map_size = %d, .state = {-1, -1, 0}, .stats = {.last_speed = -1}},\n", shadow_curve[i].map_size);
+    }
+
+    fprintf(fp, "};\n\nstatic const int embedded_profile_num = %d;\n", profile_num);
+    fprintf(fp, "static const struct profile_struct embedded_profile[MAX_PROFILES] = {\n");
+    for (int i = 0; i < profile_num; i++)
+    {
+        fprintf(fp, "    {.name = ");
+        conf_gen_string(fp, profile[i].name);
+        fprintf(fp, ", .cgroup = ");
+        conf_gen_string(fp, profile[i].cgroup);
+        fprintf(fp, ", .floor = %d, .temp_offset = %d, .revert_delay = %d, .wd_events = -1, .wd_parent = -1},\n",
+                profile[i].floor, profile[i].temp_offset, profile[i].revert_delay);
+    }
+    fprintf(fp, "};\n");
+
+    if (fclose(fp) != 0)
+    {
+        tlog(TLOG_ERROR, "Failed to write %s, %s", header_file, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+#ifdef FAN_CONTROL_EMBEDDED_CONF
+/* start from the tables compiled in, no config file is read or parsed */
+void embedded_conf_apply()
+{
+    char dir[768];
+
+    for (unsigned int i = 0; i < sizeof(embedded_int) / sizeof(embedded_int[0]); i++)
+    {
+        *embedded_int[i].var = embedded_int[i].value;
+    }
+
+    for (unsigned int i = 0; i < sizeof(embedded_str) / sizeof(embedded_str[0]); i++)
+    {
+        strncpy(embedded_str[i].var, embedded_str[i].value, embedded_str[i].size - 1);
+    }
+
+    memcpy(temp_map_storage, embedded_temp_map, sizeof(temp_map_storage));
+    temp_map = temp_map_storage;
+    temp_map_size = embedded_temp_map_size;
+
+    memcpy(sensor, embedded_sensor, sizeof(sensor));
+    sensor_num = embedded_sensor_num;
+    for (int i = 0; i < sensor_num; i++)
+    {
+        /* hwmon numbering is only known on the target */
+        if (sensor[i].type == SENSOR_HWMON && find_hwmon_by_name(sensor[i].name, dir, sizeof(dir)) == 0)
+        {
+            const char *input = strrchr(embedded_sensor[i].path, '/');
+            snprintf(sensor[i].path, sizeof(sensor[i].path), "%s/%s", dir, input != NULL ? input + 1 : "temp1_input");
         }
+        else if (sensor[i].type == SENSOR_THERMAL)
+        {
+            snprintf(sensor[i].path, sizeof(sensor[i].path), "%s%s", sysfs_root, embedded_sensor[i].path);
+        }
+    }
+
+    memcpy(fallback_sensor_path, embedded_fallback_sensor_path, sizeof(fallback_sensor_path));
+    fallback_sensor_num = embedded_fallback_sensor_num;
+    memcpy(shadow_curve, embedded_shadow_curve, sizeof(shadow_curve));
+    shadow_curve_num = embedded_shadow_curve_num;
+    memcpy(profile, embedded_profile, sizeof(profile));
+    profile_num = embedded_profile_num;
+}
+#endif
+
+void display_config()
+{
+    if (fan_mode == 0)
+    {
+        tlog(TLOG_INFO, "pwmchip: %d", pwmchip_id);
+        tlog(TLOG_INFO, "gpio: %d", pwmchip_gpio_id);
+        tlog(TLOG_INFO, "pwm-period: %d", pwm_period);
+    }
+    tlog(TLOG_INFO, "throttle-detect: %s (%d policies)", throttle_detect ? "on" : "off", cpufreq_policy_num);
+    tlog(TLOG_INFO, "auto-tune: %s", auto_tune_mode_name(auto_tune_mode));
+    if (control_mode == CONTROL_MPC)
+    {
+        tlog(TLOG_INFO, "control: mpc, horizon %ds, ceiling %d, ambient %d, budget %d", mpc_horizon, mpc_ceiling, mpc_ambient,
+             mpc_budget);
+    }
+    else
+    {
+        tlog(TLOG_INFO, "control: curve");
+    }
+#ifdef FAN_CONTROL_EMBEDDED_CONF
+    tlog(TLOG_INFO, "config: compiled in");
+#endif
+    tlog(TLOG_INFO, "threaded: %s", threaded ? "on" : "off");
+    if (dither_active())
+    {
+        tlog(TLOG_INFO, "dither: every %d ms", dither_interval);
+    }
+    tlog(TLOG_INFO, "interval: %d ms, sensor reads: %s", loop_interval_ms, sysfs_read_backend());
+    tlog(TLOG_INFO, "temp-map:");
+
+    for (int i = 0; i < temp_map_size; i++)
+    {
+        tlog(TLOG_INFO, "  speed: %d, temp: %d, duty: %d, duration: %d", temp_map[i].speed, temp_map[i].temp, temp_map[i].duty, temp_map[i].duration);
+    }
+}
+
+int init_log(int is_daemon)
+{
+    int output = log_output;
 
-        pwmchip_id = json_getInteger(pwmchipfield);
+    /* stdout is /dev/null once daemonized */
+    if (output < 0)
+    {
+        output = is_daemon ? TLOG_OUTPUT_SYSLOG : TLOG_OUTPUT_CONSOLE;
     }
 
-    json_t const *gpiofield = json_getProperty(parent, "gpio");
-    if (gpiofield != NULL)
+    tlog_set_level(log_level);
+    if (tlog_set_output(output, log_file) != 0)
     {
-        if (json_getType(gpiofield) != JSON_INTEGER)
-        {
-            printf("Invalid gpio field.\n");
-            goto errout;
-        }
+        tlog(TLOG_ERROR, "Failed to open log file %s, %s", log_file, strerror(errno));
+        tlog_set_output(is_daemon ? TLOG_OUTPUT_SYSLOG : TLOG_OUTPUT_CONSOLE, NULL);
+    }
 
-        pwmchip_gpio_id = json_getInteger(gpiofield);
+    return 0;
+}
+
+int status_init()
+{
+    if (status_file[0] == '\0')
+    {
+        return 0;
     }
 
-    json_t const *periodfield = json_getProperty(parent, "pwm-period");
-    if (periodfield != NULL)
+    int fd = open(status_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
     {
-        if (json_getType(periodfield) != JSON_INTEGER)
-        {
-            printf("Invalid period field.\n");
-            goto errout;
-        }
+        tlog(TLOG_WARN, "Failed to create status file %s, %s", status_file, strerror(errno));
+        return -1;
+    }
 
-        pwm_period = json_getInteger(periodfield);
+    if (ftruncate(fd, sizeof(struct status_page)) != 0)
+    {
+        tlog(TLOG_WARN, "Failed to size status file %s, %s", status_file, strerror(errno));
+        close(fd);
+        return -1;
     }
 
-    json_t const *temp_map_array = json_getProperty(parent, "temp-map");
-    if (temp_map_array != NULL)
+    void *page = mmap(NULL, sizeof(struct status_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
     {
-        if (json_getType(temp_map_array) != JSON_ARRAY)
-        {
-            printf("Invalid temp-map field.\n");
-            goto errout;
-        }
+        tlog(TLOG_WARN, "Failed to map status file %s, %s", status_file, strerror(errno));
+        return -1;
+    }
 
-        int temp_obj_size = 0;
-        json_t const *temp_obj;
-        for (temp_obj = json_getChild(temp_map_array); temp_obj != 0; temp_obj = json_getSibling(temp_obj))
+    status_page = page;
+    status_page_write_begin(status_page);
+    status_page->magic = STATUS_PAGE_MAGIC;
+    status_page->version = STATUS_PAGE_VERSION;
+    status_page->pid = getpid();
+    status_page->sensor_num = sensor_num < STATUS_PAGE_SENSORS ? sensor_num : STATUS_PAGE_SENSORS;
+    status_page->fan_num = 1;
+    for (unsigned int i = 0; i < status_page->sensor_num; i++)
+    {
+        /* keep the tail of long paths, it tells the sources apart */
+        const char *name = sensor[i].path;
+        size_t len = strlen(name);
+        if (len >= STATUS_PAGE_NAME_LEN)
         {
-            temp_obj_size++;
+            name += len - (STATUS_PAGE_NAME_LEN - 1);
         }
+        strncpy(status_page->sensor[i].name, name, STATUS_PAGE_NAME_LEN - 1);
+        status_page->sensor[i].offset = sensor[i].offset;
+    }
+    status_page_write_end(status_page);
 
-        if (temp_obj_size > 0)
-        {
-            temp_map_buff = (struct temp_map_struct *)malloc(sizeof(struct temp_map_struct) * temp_obj_size);
-            if (temp_map_buff == NULL)
-            {
-                printf("Failed to malloc temp_map_buff.\n");
-                goto errout;
-            }
-            memset(temp_map_buff, 0, sizeof(struct temp_map_struct) * temp_obj_size);
-
-            int id = 0;
-            for (temp_obj = json_getChild(temp_map_array); temp_obj != 0; temp_obj = json_getSibling(temp_obj))
-            {
-                if (JSON_OBJ != json_getType(temp_obj))
-                {
-                    continue;
-                }
-
-                json_t const *json_temp = json_getProperty(temp_obj, "temp");
-                json_t const *json_duty = json_getProperty(temp_obj, "duty");
-                json_t const *json_duration = json_getProperty(temp_obj, "duration");
-
-                if (json_getType(json_temp) != JSON_INTEGER)
-                {
-                    printf("Invalid temp field.\n");
-                    goto errout;
-                }
-
-                if (json_getType(json_duty) != JSON_INTEGER)
-                {
-                    printf("Invalid duty field.\n");
-                    goto errout;
-                }
+    /* the tachometer is optional, read it with the sensors when there is one */
+    fd_fan_rpm = open_fan_tach();
+    if (fd_fan_rpm >= 0)
+    {
+        id_fan_rpm = sysfs_read_register(fd_fan_rpm);
+    }
 
-                if (json_getType(json_duration) != JSON_INTEGER)
-                {
-                    printf("Invalid duration field.\n");
-                    goto errout;
-                }
+    return 0;
+}
 
-                int temp = json_getInteger(json_temp);
-                int duty = json_getInteger(json_duty);
-                int duration = json_getInteger(json_duration);
+void status_update(int temperature, int speed, int throttled)
+{
+    long long rpm = 0;
 
-                temp_map_buff[id].speed = id;
-                temp_map_buff[id].temp = temp;
-                temp_map_buff[id].duty = duty * pwm_period / 100;
-                temp_map_buff[id].duration = duration;
-                id++;
-            }
+    if (status_page == NULL)
+    {
+        return;
+    }
 
-            temp_map_size = temp_obj_size;
-            temp_map = temp_map_buff;
-        }
+    status_page_write_begin(status_page);
+    status_page->update_ms = get_monotonic_ms();
+    status_page->updates++;
+    status_page->temperature = temperature;
+    status_page->hysteresis_count = active_curve_state.count;
+    status_page->fault_flags = fault_flags;
+    status_page->throttled = throttled;
+    status_page->throttle_ms = throttle_ms;
+    status_page->passive_level = passive_level;
+    status_page->control_mode = control_mode;
+    status_page->deadline_misses = deadline_misses;
+    status_page->deadline_streak = deadline_streak;
+    status_page->watchdog_trips = atomic_load(&watchdog_trips);
+    for (unsigned int i = 0; i < status_page->sensor_num; i++)
+    {
+        status_page->sensor[i].temperature = sensor[i].valid ? (int32_t)sensor[i].value : STATUS_PAGE_NO_VALUE;
     }
 
-    return 0;
+    struct status_page_fan *fan = &status_page->fan[0];
+    fan->speed = speed;
+    fan->percent = speed >= 0 && speed < temp_map_size ? temp_map[speed].percent : 0;
+    fan->duty = speed >= 0 && speed < temp_map_size ? temp_map[speed].duty : 0;
+    fan->rpm = id_fan_rpm >= 0 && sysfs_read_value(id_fan_rpm, &rpm) == 0 ? (int32_t)rpm : STATUS_PAGE_NO_VALUE;
+    status_page_write_end(status_page);
+}
 
-errout:
-    if (temp_map_buff != NULL)
+void status_exit()
+{
+    if (status_page == NULL)
     {
-        free(temp_map_buff);
+        return;
     }
-    return -1;
+
+    munmap(status_page, sizeof(struct status_page));
+    status_page = NULL;
+    unlink(status_file);
 }
 
-int load_conf(const char *conf_file)
+void status_print_value(const char *name, int32_t value, int scale)
 {
-    FILE *fp = NULL;
-    char buff[MAX_CONF_FILE_SIZE];
-
-    fp = fopen(conf_file, "r");
-    if (fp == NULL)
+    if (value == STATUS_PAGE_NO_VALUE)
     {
-        printf("Failed to open config file, %s\n", strerror(errno));
-        return -1;
+        printf("%-18s-\n", name);
     }
-
-    memset(buff, 0, MAX_CONF_FILE_SIZE);
-    int len = fread(buff, 1, MAX_CONF_FILE_SIZE, fp);
-    if (len <= 0)
+    else if (scale > 1)
     {
-        printf("Failed to read config file, %s\n", strerror(errno));
-        goto errout;
+        printf("%-18s%.1f\n", name, (double)value / scale);
     }
-
-    if (parser_conf_json(buff) < 0)
+    else
     {
-        printf("Failed to parser config file.\n");
-        goto errout;
+        printf("%-18s%d\n", name, value);
     }
+}
 
-    fclose(fp);
-    return 0;
+int status_show()
+{
+    struct status_page snapshot;
+    char name[96];
 
-errout:
-    if (fp != NULL)
+    int fd = open(status_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
     {
-        fclose(fp);
+        printf("Failed to open status file %s, %s\n", status_file, strerror(errno));
+        return -1;
     }
 
-    return -1;
-}
+    void *page = mmap(NULL, sizeof(struct status_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        printf("Failed to map status file %s, %s\n", status_file, strerror(errno));
+        return -1;
+    }
 
-void display_config()
-{
-    if (fan_mode == 0)
+    int ret = status_page_read(page, &snapshot);
+    munmap(page, sizeof(struct status_page));
+    if (ret != 0 || snapshot.magic != STATUS_PAGE_MAGIC || snapshot.version != STATUS_PAGE_VERSION)
     {
-        printf("pwmchip: %d\n", pwmchip_id);
-        printf("gpio: %d\n", pwmchip_gpio_id);
-        printf("pwm-period: %d\n", pwm_period);
+        printf("Invalid status file %s.\n", status_file);
+        return -1;
     }
-    printf("temp-map:\n");
 
-    for (int i = 0; i < temp_map_size; i++)
+    unsigned long long now = get_monotonic_ms();
+    printf("%-18s%d\n", "pid", snapshot.pid);
+    printf("%-18s%llums ago\n", "updated", snapshot.update_ms > 0 ? now - snapshot.update_ms : 0);
+    printf("%-18s%s\n", "control", snapshot.control_mode == CONTROL_MPC ? "mpc" : "curve");
+    status_print_value("temperature", snapshot.temperature, 1000);
+    for (unsigned int i = 0; i < snapshot.sensor_num && i < STATUS_PAGE_SENSORS; i++)
+    {
+        snprintf(name, sizeof(name), "sensor%u", i);
+        status_print_value(name, snapshot.sensor[i].temperature, 1000);
+        printf("  %s, offset %d\n", snapshot.sensor[i].name, snapshot.sensor[i].offset);
+    }
+    for (unsigned int i = 0; i < snapshot.fan_num && i < 1; i++)
     {
-        printf("  speed: %d, temp: %d, duty: %d, duration: %d\n", temp_map[i].speed, temp_map[i].temp, temp_map[i].duty, temp_map[i].duration);
+        printf("fan%-15uspeed %d, duty %d%% (%d)\n", i, snapshot.fan[i].speed, snapshot.fan[i].percent, snapshot.fan[i].duty);
+        status_print_value("  rpm", snapshot.fan[i].rpm, 1);
     }
+    printf("%-18s%d\n", "hysteresis", snapshot.hysteresis_count);
+    printf("%-18s%d, %llus total\n", "throttled", snapshot.throttled, (unsigned long long)snapshot.throttle_ms / 1000);
+    printf("%-18s%d\n", "passive level", snapshot.passive_level);
+    printf("%-18s%llu, %u in a row, watchdog %u\n", "deadline misses", (unsigned long long)snapshot.deadline_misses,
+           snapshot.deadline_streak, snapshot.watchdog_trips);
+    printf("%-18s0x%x\n", "faults", snapshot.fault_flags);
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    int fd_temperature = -1;
-    char buff[32];
-    char pid_file[1024];
+    long long value = 0;
+    struct timespec next_tick;
+    char pid_file[1024] = {0};
     char conf_file[1024] = {0};
     int temperatrue = 0;
+    int throttled = 0;
     int speed_set = -1;
+    int last_published = -1;
     int is_daemon = 0;
+    int reexeced = getenv(REEXEC_ENV) != NULL;
 
     int opt;
+    int characterize = 0;
+    int show_status = 0;
+    const char *lease_request = NULL;
+    static struct option long_options[] = {
+        {"characterize", no_argument, NULL, 'C'},
+        {"status", optional_argument, NULL, 'S'},
+        {"sysfs-root", required_argument, NULL, 'r'},
+        {"lease", required_argument, NULL, 'L'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
 
-    while ((opt = getopt(argc, argv, "s:p:c:dh")) != -1)
+#ifdef FAN_CONTROL_FIXED_MEMORY
+    stack_paint();
+#endif
+
+    main_argv = argv;
+    unsetenv(REEXEC_ENV);
+
+#ifdef FAN_CONTROL_CONF_GEN
+    tlog_init();
+    if (argc != 3)
+    {
+        printf("Usage: %s <config file> <header file>\n", argv[0]);
+        return 1;
+    }
+    return conf_gen(argv[1], argv[2]) == 0 ? 0 : 1;
+#endif
+
+    while ((opt = getopt_long(argc, argv, "s:p:c:r:dCh", long_options, NULL)) != -1)
     {
         switch (opt)
         {
+        case 'C':
+            characterize = 1;
+            break;
+        case 'r':
+            init_sysfs_paths(optarg);
+            break;
+        case 'L':
+            lease_request = optarg;
+            break;
+        case 'S':
+            show_status = 1;
+            if (optarg != NULL)
+            {
+                strncpy(status_file, optarg, sizeof(status_file) - 1);
+            }
+            break;
         case 's':
             speed_set = atoi(optarg);
             break;
@@ -591,22 +5744,66 @@ int main(int argc, char *argv[])
         }
     }
 
+    tlog_init();
+    sysfs_read_init(0);
+
+#ifdef FAN_CONTROL_EMBEDDED_CONF
+    /* the settings are compiled in, a config file given with -c only overrides them */
+    int read_conf = conf_file[0] != 0;
+    embedded_conf_apply();
+#else
+    int read_conf = 1;
+#endif
+
     if (conf_file[0] == 0)
     {
         strncpy(conf_file, DEFAULT_CONF_PATH, sizeof(conf_file) - 1);
     }
 
-    if (load_conf(conf_file) != 0)
+    if (show_status)
+    {
+        /* the config only matters for where the status file is */
+        if (read_conf && access(conf_file, R_OK) == 0 && strcmp(status_file, DEFAULT_STATUS_PATH) == 0)
+        {
+            load_conf(conf_file);
+        }
+        return status_show() == 0 ? 0 : 1;
+    }
+
+    if (lease_request != NULL)
+    {
+        if (read_conf && access(conf_file, R_OK) == 0)
+        {
+            load_conf(conf_file);
+        }
+        return lease_client(lease_request) == 0 ? 0 : 1;
+    }
+
+    if (read_conf && load_conf(conf_file) != 0)
     {
-        fprintf(stderr, "load config file failed.\n");
+        tlog(TLOG_ERROR, "load config file failed.");
         return 1;
     }
 
+    init_log(is_daemon);
+    sysfs_read_init(use_io_uring);
+
+    int offloaded = 0;
+    if (offload_mode != OFFLOAD_OFF && speed_set == -1 && !characterize)
+    {
+        offloaded = offload_thermal() == 0;
+        if (offloaded && offload_mode == OFFLOAD_EXIT)
+        {
+            return 0;
+        }
+    }
+
+    notify_init();
     if (is_daemon)
     {
-        if (daemon(0, 0) != 0)
+        if (!reexeced && daemon(0, 0) != 0)
         {
-            printf("run daemon failed.\n");
+            tlog(TLOG_ERROR, "run daemon failed.");
             return 1;
         }
 
@@ -621,73 +5818,321 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (offloaded)
+    {
+        offload_park();
+        if (exit_request == EXIT_REEXEC)
+        {
+            reexec();
+        }
+        return 0;
+    }
+
+    /* threads do not survive daemon(), start the log thread afterwards */
+    if (speed_set == -1)
+    {
+        if (tlog_start() != 0)
+        {
+            tlog(TLOG_WARN, "Failed to start log thread, log synchronously.");
+        }
+        atexit(tlog_exit);
+    }
+
+    if (speed_set == -1 && !characterize)
+    {
+        handover_load();
+    }
+
     if (init_pwm_GPIO())
     {
         if (init_thermal())
         {
-            printf("Failed to init thermal.\n");
+            tlog(TLOG_ERROR, "Failed to init thermal.");
+            return 1;
+        }
+    }
+
+    if (characterize)
+    {
+        return characterize_fan() == 0 ? 0 : 1;
+    }
+
+    if (load_calibration() == 0)
+    {
+        tlog(TLOG_INFO, "Fan calibration loaded, temp-map duty is a share of the maximum fan speed.");
+    }
+    update_temp_map();
+    handover_apply();
+
+    if ((throttle_detect || passive_ceiling > 0 || efficiency_enable) && speed_set == -1)
+    {
+        if (init_throttle_detect() != 0)
+        {
+            throttle_detect = 0;
+            passive_ceiling = 0;
+        }
+    }
+
+    if (speed_set == -1)
+    {
+        if (init_sensors() != 0)
+        {
+            return 1;
+        }
+        init_fallback_sensors();
+        status_init();
+        if (profile_init() != 0)
+        {
             return 1;
         }
+        lease_init();
+        if (efficiency_enable)
+        {
+            efficiency_load_baseline();
+        }
+
+        if (sysfs_read_start() != 0)
+        {
+            tlog(TLOG_WARN, "io_uring is not available, read sensors with pread.");
+        }
+    }
 
-        update_temp_map();
+    if (control_mode == CONTROL_MPC)
+    {
+        mpc_init();
+    }
+
+    if (auto_tune_mode != AUTO_TUNE_OFF && speed_set == -1)
+    {
+        auto_tune_init();
+        if (auto_tune_load() == 0 && auto_tune_mode == AUTO_TUNE_APPLY && thermal_model_valid(&auto_tune_model))
+        {
+            auto_tune_apply(-1, 0);
+        }
     }
 
     display_config();
 
     if (speed_set != -1)
     {
-        printf("Set speed to %d.\n", speed_set);
+        tlog(TLOG_INFO, "Set speed to %d.", speed_set);
         if (speed_set < 0 || speed_set >= temp_map_size)
         {
-            fprintf(stderr, "speed is invalid.\n");
+            tlog(TLOG_ERROR, "speed is invalid.");
             return 1;
         }
 
         if (set_speed(speed_set) != 0)
         {
-            printf("Set speed to %d failed.\n", speed_set);
+            tlog(TLOG_ERROR, "Set speed to %d failed.", speed_set);
             return 1;
         }
 
         return 0;
     }
 
-    fd_temperature = open(TEMP_PATH, O_RDONLY);
-    if (fd_temperature < 0)
+    if (threaded && start_actuator() != 0)
     {
-        printf("Failed to open temperature file, %s\n", strerror(errno));
-        return -1;
+        tlog(TLOG_WARN, "Failed to start actuator thread, write fan speed inline.");
     }
 
-    while (1)
+    failsafe_prepare();
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sig_exit;
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGUSR2, &act, NULL);
+    act.sa_handler = sig_show_memory;
+    sigaction(SIGUSR1, &act, NULL);
+    act.sa_handler = sig_fatal;
+    act.sa_flags = SA_RESETHAND;
+    sigaction(SIGSEGV, &act, NULL);
+    sigaction(SIGBUS, &act, NULL);
+    sigaction(SIGFPE, &act, NULL);
+    sigaction(SIGILL, &act, NULL);
+    sigaction(SIGABRT, &act, NULL);
+#ifdef FAN_CONTROL_FIXED_MEMORY
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        tlog(TLOG_WARN, "Failed to lock memory, %s", strerror(errno));
+    }
+    memory_init_done = 1;
+#endif
+    show_memory_usage();
+
+    if (start_watchdog() != 0)
+    {
+        tlog(TLOG_WARN, "Failed to start watchdog thread.");
+    }
+
+    if (notify_watchdog_ms > 0 && (unsigned long long)loop_interval_ms * 2 > notify_watchdog_ms)
+    {
+        tlog(TLOG_WARN, "interval %d ms is too long for the service watchdog of %llu ms.", loop_interval_ms, notify_watchdog_ms);
+    }
+
+    int early_tick = 0;
+    unsigned long long published_ms = 0;
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
+    while (!exit_request)
     {
-        sleep(1);
+        /* absolute deadlines, the work done in a tick does not stretch the interval */
+        if (!early_tick)
+        {
+            next_tick.tv_nsec += (long)(loop_interval_ms % 1000) * 1000000;
+            next_tick.tv_sec += loop_interval_ms / 1000 + next_tick.tv_nsec / 1000000000;
+            next_tick.tv_nsec %= 1000000000;
+        }
+        early_tick = loop_wait(&next_tick);
+        unsigned long long tick_ms = (unsigned long long)next_tick.tv_sec * 1000 + next_tick.tv_nsec / 1000000;
+        if (early_tick)
+        {
+            tick_ms = get_monotonic_ms();
+        }
 
-        lseek(fd_temperature, 0, SEEK_SET);
-        if (read(fd_temperature, &buff, 32) <= 0)
+        if (exit_request)
         {
-            perror("read");
-            goto errout;
+            break;
+        }
+
+        if (atomic_load(&fault_flags) & FAULT_LOOP_STALL)
+        {
+            /* the watchdog wrote the safe duty behind our back, write the curve again */
+            tlog(TLOG_NOTICE, "Control loop running again.");
+            atomic_fetch_and(&fault_flags, ~FAULT_LOOP_STALL);
+            if (actuator_running)
+            {
+                /* set_speed_last belongs to the actuator, it resets it with the next decision */
+                atomic_store(&actuator_rewrite, 1);
+            }
+            else
+            {
+                set_speed_last = temp_map_size;
+            }
+            last_published = -1;
+        }
+
+        if (show_memory_request)
+        {
+            show_memory_request = 0;
+            show_memory_usage();
+            shadow_show();
+            efficiency_show();
+        }
+
+        sysfs_read_batch(NULL, 0);
+        throttled = throttle_detect ? check_throttle() : 0;
+        int read_ret = read_temperature(&value);
+
+        if (read_ret != 0)
+        {
+            /* no sensor left to trust, cool as hard as we can until one comes back */
+            speed_set = temp_map_size - 1;
+        }
+        else if (control_mode == CONTROL_MPC)
+        {
+            temperatrue = (int)value;
+            speed_set = mpc_get_speed(temperatrue + profile_temp_offset * 1000, throttled);
+        }
+        else
+        {
+            temperatrue = (int)value;
+            speed_set = get_speed(temperatrue / 1000 + profile_temp_offset, throttled);
+        }
+
+        if (profile_num > 0)
+        {
+            profile_update(get_monotonic_ms());
+            speed_set = speed_set < profile_floor_speed ? profile_floor_speed : speed_set;
+        }
+
+        if (lease_num > 0)
+        {
+            int lease_speed = lease_floor_speed(temperatrue / 1000);
+            speed_set = speed_set < lease_speed ? lease_speed : speed_set;
+        }
+
+        int actuated = 0;
+        if (actuator_running)
+        {
+            /* dithering needs the actuator to step on every tick, not only on level changes */
+            if (speed_set != last_published || dither_active())
+            {
+                struct speed_decision_struct decision = {get_monotonic_ms(), temperatrue, speed_set};
+                decision_publish(&decision);
+                last_published = speed_set;
+                published_ms = decision.timestamp_ms;
+            }
+        }
+        else
+        {
+            actuated = set_speed(speed_set) == 0;
+        }
+
+        if (auto_tune_mode != AUTO_TUNE_OFF && !(fault_flags & FAULT_SENSOR_LOST))
+        {
+            auto_tune_sample(temperatrue, speed_set);
+        }
+
+        if (passive_ceiling > 0 && read_ret == 0)
+        {
+            passive_update(temperatrue / 1000, speed_set);
         }
 
-        temperatrue = atoi(buff);
-        speed_set = get_speed(temperatrue / 1000);
-        set_speed(speed_set);
+        if (efficiency_enable && read_ret == 0)
+        {
+            efficiency_update(speed_set);
+        }
+
+        status_update(temperatrue, speed_set, throttled);
+
+        if (shadow_curve_num > 0)
+        {
+            curve_stats_update(&active_curve_stats, speed_set, temp_map[speed_set].percent);
+            shadow_update(temperatrue / 1000, throttled, read_ret == 0);
+        }
 
         if (!is_daemon)
         {
-            printf("speed:%d  temperatrue:%d\n", speed_set, temperatrue);
+            tlog(TLOG_INFO, "speed:%d  temperatrue:%d  throttled:%llus  faults:0x%x", speed_set, temperatrue, throttle_ms / 1000,
+                 (int)fault_flags);
+        }
+
+        deadline_check(tick_ms, published_ms, actuated);
+        if (deadline_streak > 0)
+        {
+            /* late already, start the next interval from now instead of catching up in a burst */
+            clock_gettime(CLOCK_MONOTONIC, &next_tick);
         }
     }
-    close(fd_temperature);
-    return 0;
 
-errout:
-    if (fd_temperature > 0)
+    stop_actuator();
+    shadow_show();
+    passive_restore();
+    status_exit();
+    lease_exit();
+    handover_save(exit_request != EXIT_STOP);
+    if (exit_request == EXIT_REEXEC)
+    {
+        close_sensors();
+        reexec();
+        return 0;
+    }
+    else if (exit_request == EXIT_HANDOVER)
+    {
+        /* a successor takes over within handover-timeout, leave the fan as it is */
+        tlog(TLOG_NOTICE, "Exit for handover, keep fan at speed %d.", set_speed_last);
+    }
+    else
     {
-        close(fd_temperature);
-        fd_temperature = -1;
+        tlog(TLOG_NOTICE, "Exit, set fan to safe duty %d%%.", failsafe_safe_duty);
+        if (failsafe_write_verified() != 0)
+        {
+            tlog(TLOG_ERROR, "Failed to set safe duty, %s", strerror(errno));
+        }
     }
 
-    return 1;
+    close_sensors();
+    return 0;
 }
@@ -29,6 +29,11 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
 #include "tiny-json.h"
 
 /** Structure to handle a heap of JSON properties. */
@@ -48,6 +53,88 @@ json_t const* json_getProperty( json_t const* obj, char const* property ) {
     return 0;
 }
 
+/** Hash table of one object, kept in spare pool entries and listed from the
+  * index. The parsed properties themselves are never modified. */
+typedef struct jsonTable_s {
+    struct jsonTable_s const* next; /**< Previously built table.       */
+    json_t const* obj;              /**< The indexed object.           */
+    unsigned int mask;              /**< Number of slots minus one.    */
+    json_t const* slot[];           /**< Properties, null if empty.    */
+} jsonTable_t;
+
+/** FNV-1a hash of a property name.
+  * @param str Null-terminated name.
+  * @return The hash value. */
+static unsigned int hashName( char const* str ) {
+    unsigned int hash = 2166136261u;
+    for( ; *str; ++str ) {
+        hash ^= (unsigned char)*str;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/** Build the hash table of an object from spare pool entries.
+  * @param index The index handler.
+  * @param obj The object to index.
+  * @retval The table if success.
+  * @retval Null pointer if the object is small or the pool has no room. */
+static jsonTable_t const* buildTable( jsonIndex_t* index, json_t const* obj ) {
+    unsigned int count = 0;
+    json_t const* sibling;
+    for( sibling = obj->u.c.child; sibling; sibling = sibling->sibling )
+        ++count;
+    unsigned int slots = 8;
+    while( slots < count * 2 ) slots *= 2;
+    size_t const bytes = sizeof( jsonTable_t ) + slots * sizeof( json_t const* );
+    unsigned int const entries = ( bytes + sizeof( json_t ) - 1 ) / sizeof( json_t );
+    if ( index->qty - index->nextFree < entries ) return 0;
+    jsonTable_t* table = (jsonTable_t*)( index->mem + index->nextFree );
+    index->nextFree += entries;
+    memset( table, 0, bytes );
+    table->next = index->tables;
+    table->obj = obj;
+    table->mask = slots - 1;
+    for( sibling = obj->u.c.child; sibling; sibling = sibling->sibling ) {
+        unsigned int i = hashName( sibling->name ) & table->mask;
+        while( table->slot[i] && strcmp( table->slot[i]->name, sibling->name ) )
+            i = ( i + 1 ) & table->mask;
+        if ( !table->slot[i] ) table->slot[i] = sibling;
+    }
+    index->tables = table;
+    return table;
+}
+
+/** Tell whether an object has fewer properties than are worth indexing.
+  * @param obj The object.
+  * @return true if it is searched linearly. */
+static bool isSmall( json_t const* obj ) {
+    unsigned int count = 0;
+    json_t const* sibling;
+    for( sibling = obj->u.c.child; sibling && count < JSON_INDEX_MIN_PROPERTIES; sibling = sibling->sibling )
+        ++count;
+    return count < JSON_INDEX_MIN_PROPERTIES;
+}
+
+/* Search a property by its name in a JSON object, through a hash index. */
+json_t const* json_getPropertyIndexed( jsonIndex_t* index, json_t const* obj, char const* property ) {
+    json_t const* const first = index->mem;
+    json_t const* const spare = index->mem + index->parsed;
+    if ( obj < first || obj >= spare || obj->type != JSON_OBJ || isSmall( obj ) )
+        return json_getProperty( obj, property );
+    jsonTable_t const* table;
+    for( table = index->tables; table; table = table->next )
+        if ( table->obj == obj ) break;
+    if ( !table ) table = buildTable( index, obj );
+    if ( !table )
+        return json_getProperty( obj, property );
+    unsigned int i = hashName( property ) & table->mask;
+    for( ; table->slot[i]; i = ( i + 1 ) & table->mask )
+        if ( !strcmp( table->slot[i]->name, property ) )
+            return table->slot[i];
+    return 0;
+}
+
 /* Search a property by its name in a JSON object and return its value. */
 char const* json_getPropertyValue( json_t const* obj, char const* property ) {
 	json_t const* field = json_getProperty( obj, property );
@@ -89,6 +176,22 @@ json_t const* json_create( char* str, json_t mem[], unsigned int qty ) {
     return json_createWithPool( str, &spool.pool );
 }
 
+/* Parse a string to get a json that can be searched through an index. */
+json_t const* json_createIndexed( char* str, json_t mem[], unsigned int qty, jsonIndex_t* index ) {
+    jsonStaticPool_t spool;
+    spool.mem = mem;
+    spool.qty = qty;
+    spool.pool.init = poolInit;
+    spool.pool.alloc = poolAlloc;
+    json_t const* json = json_createWithPool( str, &spool.pool );
+    index->mem = mem;
+    index->qty = qty;
+    index->parsed = json ? spool.nextFree : 0;
+    index->nextFree = index->parsed;
+    index->tables = 0;
+    return json;
+}
+
 /** Get a special character with its escape character. Examples:
   * 'b' -> '\\b', 'n' -> '\\n', 't' -> '\\t'
   * @param ch The escape character.
@@ -109,14 +212,18 @@ static char getEscape( char ch ) {
 
 /** Parse 4 characters.
   * @param str Pointer to  first digit.
-  * @retval '?' If the four characters are hexadecimal digits.
+  * @retval The character if the four characters are hexadecimal digits of an ASCII code point.
+  * @retval '?' If they are hexadecimal digits of any other code point.
   * @retval '\0' In other cases. */
 static unsigned char getCharFromUnicode( unsigned char const* str ) {
     unsigned int i;
-    for( i = 0; i < 4; ++i )
+    unsigned int code = 0;
+    for( i = 0; i < 4; ++i ) {
         if ( !isxdigit( str[i] ) )
             return '\0';
-    return '?';
+        code = code * 16 + ( isdigit( str[i] ) ? str[i] - '0' : ( tolower( str[i] ) - 'a' + 10 ) );
+    }
+    return code > 0 && code < 0x80 ? (unsigned char)code : '?';
 }
 
 /** Parse a string and replace the scape characters by their meaning characters.
@@ -459,3 +566,207 @@ static char* setToNull( char* ch ) {
 static bool isEndOfPrimitive( char ch ) {
     return ch == ',' || isOneOfThem( ch, blank ) || isOneOfThem( ch, endofblock );
 }
+
+/** Write out the staging buffer of a writer on a file descriptor. */
+static void writerFlush( jsonWriter_t* writer ) {
+    size_t done = 0;
+    while( done < writer->len ) {
+        ssize_t const ret = write( writer->fd, writer->buf + done, writer->len - done );
+        if ( ret < 0 && errno == EINTR ) continue;
+        if ( ret <= 0 ) {
+            writer->error = true;
+            break;
+        }
+        done += (size_t)ret;
+    }
+    writer->total += done;
+    writer->len = 0;
+}
+
+/** Append bytes to the output, keeping room for the null terminator in buffer mode. */
+static void writerPut( jsonWriter_t* writer, char const* str, size_t len ) {
+    while( len > 0 && !writer->error ) {
+        size_t room = writer->size - writer->len - ( writer->fd < 0 ? 1 : 0 );
+        if ( room == 0 ) {
+            if ( writer->fd < 0 ) {
+                writer->error = true;
+                return;
+            }
+            writerFlush( writer );
+            continue;
+        }
+        size_t const n = len < room ? len : room;
+        memcpy( writer->buf + writer->len, str, n );
+        writer->len += n;
+        str += n;
+        len -= n;
+    }
+}
+
+static void writerPutStr( jsonWriter_t* writer, char const* str ) {
+    writerPut( writer, str, strlen( str ) );
+}
+
+static void writerIndent( jsonWriter_t* writer ) {
+    unsigned int i;
+    if ( !writer->pretty ) return;
+    writerPut( writer, "\n", 1 );
+    for( i = 0; i < writer->depth; ++i )
+        writerPut( writer, "    ", 4 );
+}
+
+/** Write a quoted string, escaping what json_create() needs to get it back. */
+static void writerQuote( jsonWriter_t* writer, char const* str ) {
+    static char const hex[] = "0123456789abcdef";
+    writerPut( writer, "\"", 1 );
+    for( ; *str; ++str ) {
+        unsigned char const ch = (unsigned char)*str;
+        char esc[6] = { '\\', 0, 0, 0, 0, 0 };
+        size_t len = 2;
+        switch( ch ) {
+            case '\"': esc[1] = '\"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            default:
+                if ( ch >= 0x20 ) {
+                    writerPut( writer, str, 1 );
+                    continue;
+                }
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[ch >> 4];
+                esc[5] = hex[ch & 0xf];
+                len = 6;
+        }
+        writerPut( writer, esc, len );
+    }
+    writerPut( writer, "\"", 1 );
+}
+
+/** Write the separator, the indentation and the name that precede a value. */
+static void writerValue( jsonWriter_t* writer, char const* name ) {
+    if ( writer->depth > 0 ) {
+        uint32_t const bit = 1u << ( writer->depth - 1 );
+        /* properties of an object have a name, elements of an array have none */
+        if ( !name != !!( writer->array & bit ) ) writer->error = true;
+        if ( !( writer->empty & bit ) ) writerPut( writer, ",", 1 );
+        writer->empty &= ~bit;
+        writerIndent( writer );
+    }
+    else if ( writer->len > 0 || writer->total > 0 || name ) writer->error = true;
+    if ( name ) {
+        writerQuote( writer, name );
+        writerPutStr( writer, writer->pretty ? ": " : ":" );
+    }
+}
+
+static void writerOpen( jsonWriter_t* writer, char const* name, char const* bracket ) {
+    writerValue( writer, name );
+    writerPutStr( writer, bracket );
+    if ( writer->depth >= JSON_WRITER_MAX_DEPTH ) {
+        writer->error = true;
+        return;
+    }
+    writer->empty |= 1u << writer->depth;
+    if ( *bracket == '[' ) writer->array |= 1u << writer->depth;
+    else writer->array &= ~( 1u << writer->depth );
+    ++writer->depth;
+}
+
+static void writerClose( jsonWriter_t* writer, char const* bracket ) {
+    if ( writer->depth == 0 ) {
+        writer->error = true;
+        return;
+    }
+    --writer->depth;
+    if ( !( writer->array & ( 1u << writer->depth ) ) != ( *bracket == '}' ) ) writer->error = true;
+    if ( !( writer->empty & ( 1u << writer->depth ) ) ) writerIndent( writer );
+    writerPutStr( writer, bracket );
+}
+
+void json_writerInit( jsonWriter_t* writer, char* buf, size_t size, bool pretty ) {
+    memset( writer, 0, sizeof *writer );
+    writer->buf = buf;
+    writer->size = size;
+    writer->fd = -1;
+    writer->pretty = pretty;
+    writer->error = size == 0;
+}
+
+void json_writerInitFd( jsonWriter_t* writer, int fd, char* buf, size_t size, bool pretty ) {
+    json_writerInit( writer, buf, size, pretty );
+    writer->fd = fd;
+}
+
+int json_writerEnd( jsonWriter_t* writer ) {
+    if ( writer->depth != 0 || ( writer->len == 0 && writer->total == 0 ) ) writer->error = true;
+    if ( writer->pretty ) writerPut( writer, "\n", 1 );
+    if ( writer->fd >= 0 ) {
+        if ( !writer->error ) writerFlush( writer );
+        return writer->error ? -1 : (int)writer->total;
+    }
+    if ( writer->size > 0 ) writer->buf[writer->len] = '\0';
+    return writer->error ? -1 : (int)writer->len;
+}
+
+void json_writeObjOpen( jsonWriter_t* writer, char const* name ) {
+    writerOpen( writer, name, "{" );
+}
+
+void json_writeObjClose( jsonWriter_t* writer ) {
+    writerClose( writer, "}" );
+}
+
+void json_writeArrOpen( jsonWriter_t* writer, char const* name ) {
+    writerOpen( writer, name, "[" );
+}
+
+void json_writeArrClose( jsonWriter_t* writer ) {
+    writerClose( writer, "]" );
+}
+
+void json_writeText( jsonWriter_t* writer, char const* name, char const* value ) {
+    writerValue( writer, name );
+    writerQuote( writer, value );
+}
+
+void json_writeInteger( jsonWriter_t* writer, char const* name, int64_t value ) {
+    char num[24];
+    writerValue( writer, name );
+    writerPut( writer, num, (size_t)snprintf( num, sizeof num, "%" PRId64, value ) );
+}
+
+void json_writeReal( jsonWriter_t* writer, char const* name, double value ) {
+    char num[32];
+    int len = 0;
+    int precision;
+    if ( isnan( value ) || isinf( value ) ) {
+        json_writeNull( writer, name );
+        return;
+    }
+    for( precision = 15; precision <= 17; ++precision ) {
+        len = snprintf( num, sizeof num, "%.*g", precision, value );
+        if ( strtod( num, NULL ) == value ) break;
+    }
+    if ( !strpbrk( num, ".eE" ) ) {
+        num[len++] = '.';
+        num[len++] = '0';
+    }
+    writerValue( writer, name );
+    writerPut( writer, num, (size_t)len );
+}
+
+void json_writeBoolean( jsonWriter_t* writer, char const* name, bool value ) {
+    writerValue( writer, name );
+    writerPutStr( writer, value ? "true" : "false" );
+}
+
+void json_writeNull( jsonWriter_t* writer, char const* name ) {
+    writerValue( writer, name );
+    writerPutStr( writer, "null" );
+}
@@ -167,6 +167,104 @@ struct jsonPool_s {
   *         This property is always unnamed and its type is JSON_OBJ. */
 json_t const* json_createWithPool( char* str, jsonPool_t* pool );
 
+/** Structure to handle a lazily built property index.
+  * The spare entries of the json pool, after the ones used by the parser,
+  * hold one open-addressing hash table per indexed object. The tables are
+  * listed from the index, the parsed properties are left untouched. */
+typedef struct jsonIndex_s {
+    json_t* mem;           /**< Pointer to array of json properties.           */
+    unsigned int qty;      /**< Length of the array of json properties.        */
+    unsigned int parsed;   /**< Number of properties used by the parser.       */
+    unsigned int nextFree; /**< The index of the next free json property.      */
+    struct jsonTable_s const* tables; /**< Tables built so far, newest first. */
+} jsonIndex_t;
+
+/** Objects with fewer properties are always searched linearly. */
+#define JSON_INDEX_MIN_PROPERTIES 6
+
+/** Parse a string to get a json whose objects can be searched with
+  * json_getPropertyIndexed().
+  * @param str String pointer with a JSON object. It will be modified.
+  * @param mem Array of json properties to allocate. Entries left over after
+  *            parsing are used for the indexes.
+  * @param qty Number of elements of mem.
+  * @param index Index handler to initialize. It must live as long as the json.
+  * @retval Null pointer if any was wrong in the parse process.
+  * @retval If the parser process was successfully a valid handler of a json. */
+json_t const* json_createIndexed( char* str, json_t mem[], unsigned int qty, jsonIndex_t* index );
+
+/** Search a property by its name in a JSON object, through a hash index.
+  * The index of an object is built on its first search. When the pool has no
+  * room left, or obj does not belong to the index, it falls back to
+  * json_getProperty(). If several properties share the name the first one
+  * is returned, as json_getProperty() does.
+  * @param index The index handler given to json_createIndexed().
+  * @param obj A valid handler of a json object. Its type must be JSON_OBJ.
+  * @param property The name of property to get.
+  * @retval The handler of the json property if found.
+  * @retval Null pointer if not found. */
+json_t const* json_getPropertyIndexed( jsonIndex_t* index, json_t const* obj, char const* property );
+
+/** Structure to handle a streaming JSON writer.
+  * Nothing is allocated: the output goes to the buffer given to
+  * json_writerInit(), or through it to a file descriptor. */
+typedef struct jsonWriter_s {
+    char* buf;         /**< Output buffer, or staging buffer for the fd.   */
+    size_t size;       /**< Size of buf.                                   */
+    size_t len;        /**< Bytes held in buf.                             */
+    size_t total;      /**< Bytes written to the fd so far.                */
+    int fd;            /**< File descriptor to flush to, -1 for a buffer.  */
+    unsigned int depth;/**< Number of open objects and arrays.             */
+    uint32_t empty;    /**< One bit per depth, set until a value is added. */
+    uint32_t array;    /**< One bit per depth, set for an array.           */
+    bool pretty;       /**< Indent with 4 spaces, one value per line.      */
+    bool error;        /**< Overflow, bad nesting or a failed write.       */
+} jsonWriter_t;
+
+/** Maximum nesting of objects and arrays in a writer. */
+#define JSON_WRITER_MAX_DEPTH 32
+
+/** Start writing JSON into a buffer.
+  * @param writer Writer handler to initialize.
+  * @param buf Buffer for the whole text, including the null terminator.
+  * @param size Size of buf.
+  * @param pretty Indent the output. */
+void json_writerInit( jsonWriter_t* writer, char* buf, size_t size, bool pretty );
+
+/** Start writing JSON to a file descriptor.
+  * @param writer Writer handler to initialize.
+  * @param fd File descriptor, written whenever buf is full and at the end.
+  * @param buf Staging buffer.
+  * @param size Size of buf.
+  * @param pretty Indent the output. */
+void json_writerInitFd( jsonWriter_t* writer, int fd, char* buf, size_t size, bool pretty );
+
+/** Finish the text. Every object and array must have been closed.
+  * @param writer A valid writer handler.
+  * @retval The length of the text, without the null terminator, if success.
+  * @retval -1 if the buffer was too small, the nesting was wrong or a write failed. */
+int json_writerEnd( jsonWriter_t* writer );
+
+/** The functions below add a value. name is the property name inside an
+  * object, and must be null for the root value and inside arrays; a missing
+  * or stray name, like a close of the wrong kind, is an error. Errors are
+  * kept until json_writerEnd(). */
+void json_writeObjOpen( jsonWriter_t* writer, char const* name );
+void json_writeObjClose( jsonWriter_t* writer );
+void json_writeArrOpen( jsonWriter_t* writer, char const* name );
+void json_writeArrClose( jsonWriter_t* writer );
+
+/** Add a string, escaped so that json_create() gives it back unchanged. */
+void json_writeText( jsonWriter_t* writer, char const* name, char const* value );
+void json_writeInteger( jsonWriter_t* writer, char const* name, int64_t value );
+
+/** Add a real with the fewest digits that read back to the same double. It
+  * always has a fraction or an exponent, so it parses as JSON_REAL. NaN and
+  * infinities are written as null. */
+void json_writeReal( jsonWriter_t* writer, char const* name, double value );
+void json_writeBoolean( jsonWriter_t* writer, char const* name, bool value );
+void json_writeNull( jsonWriter_t* writer, char const* name );
+
 /** @ } */
 
 #ifdef __cplusplus
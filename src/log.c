@@ -0,0 +1,469 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <syslog.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "log.h"
+
+#define TLOG_RING_SIZE 128
+#define TLOG_MSG_LEN 224
+#define TLOG_FILE_PATH_LEN 1024
+#define TLOG_THREAD_STACK_SIZE (64 * 1024)
+#define TLOG_SYSLOG_PATH "/dev/log"
+
+struct tlog_slot
+{
+    atomic_uint seq;
+    int level;
+    int line;
+    const char *file;
+    struct timespec ts;
+    char msg[TLOG_MSG_LEN];
+};
+
+struct tlog_struct
+{
+    struct tlog_slot ring[TLOG_RING_SIZE];
+    atomic_uint tail;
+    unsigned int head;
+    atomic_uint dropped;
+    atomic_int waiting;
+    atomic_int async;
+    atomic_int run;
+    sem_t sem;
+    pthread_t tid;
+    int level;
+    tlog_output output;
+    int fd;
+    int syslog_fd;
+    char file[TLOG_FILE_PATH_LEN];
+};
+
+static struct tlog_struct tlog_ctx;
+
+static const char *tlog_level_str[TLOG_END] = {"DEBUG", "INFO", "NOTICE", "WARN", "ERROR", "FATAL"};
+static const int tlog_syslog_prio[TLOG_END] = {LOG_DEBUG, LOG_INFO, LOG_NOTICE, LOG_WARNING, LOG_ERR, LOG_CRIT};
+
+int tlog_init(void)
+{
+    memset(&tlog_ctx, 0, sizeof(tlog_ctx));
+    for (unsigned int i = 0; i < TLOG_RING_SIZE; i++)
+    {
+        atomic_init(&tlog_ctx.ring[i].seq, i);
+    }
+
+    tlog_ctx.level = TLOG_INFO;
+    tlog_ctx.output = TLOG_OUTPUT_CONSOLE;
+    tlog_ctx.fd = -1;
+    tlog_ctx.syslog_fd = -1;
+
+    /* load the time zone now, localtime_r() would do it lazily on the log thread */
+    tzset();
+    if (sem_init(&tlog_ctx.sem, 0, 0) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* talk to /dev/log directly, glibc syslog() allocates a memstream per message */
+static int tlog_syslog_connect(void)
+{
+    struct sockaddr_un addr;
+
+    if (tlog_ctx.syslog_fd >= 0)
+    {
+        close(tlog_ctx.syslog_fd);
+    }
+
+    tlog_ctx.syslog_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (tlog_ctx.syslog_fd < 0)
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, TLOG_SYSLOG_PATH, sizeof(addr.sun_path) - 1);
+    if (connect(tlog_ctx.syslog_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(tlog_ctx.syslog_fd);
+        tlog_ctx.syslog_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void tlog_syslog_write(int level, const struct timespec *ts, const char *msg)
+{
+    char buff[TLOG_MSG_LEN + 64];
+    char timestr[32];
+    struct tm tm;
+
+    localtime_r(&ts->tv_sec, &tm);
+    strftime(timestr, sizeof(timestr), "%b %e %H:%M:%S", &tm);
+    int len = snprintf(buff, sizeof(buff), "<%d>%s fan-control[%d]: %s", LOG_DAEMON | tlog_syslog_prio[level], timestr,
+                       (int)getpid(), msg);
+    if (len > (int)sizeof(buff) - 1)
+    {
+        len = sizeof(buff) - 1;
+    }
+
+    /* the log daemon may have been restarted, reconnect once */
+    for (int i = 0; i < 2; i++)
+    {
+        if (tlog_ctx.syslog_fd < 0 && tlog_syslog_connect() != 0)
+        {
+            return;
+        }
+
+        if (send(tlog_ctx.syslog_fd, buff, len, MSG_NOSIGNAL) >= 0)
+        {
+            return;
+        }
+
+        close(tlog_ctx.syslog_fd);
+        tlog_ctx.syslog_fd = -1;
+    }
+}
+
+int tlog_set_output(tlog_output output, const char *file)
+{
+    if (tlog_ctx.fd >= 0)
+    {
+        close(tlog_ctx.fd);
+        tlog_ctx.fd = -1;
+    }
+
+    if (tlog_ctx.syslog_fd >= 0)
+    {
+        close(tlog_ctx.syslog_fd);
+        tlog_ctx.syslog_fd = -1;
+    }
+
+    if (output == TLOG_OUTPUT_FILE)
+    {
+        int fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+        if (fd < 0)
+        {
+            return -1;
+        }
+
+        strncpy(tlog_ctx.file, file, TLOG_FILE_PATH_LEN - 1);
+        tlog_ctx.fd = fd;
+    }
+    else if (output == TLOG_OUTPUT_SYSLOG)
+    {
+        tlog_syslog_connect();
+    }
+
+    tlog_ctx.output = output;
+    return 0;
+}
+
+void tlog_set_level(tlog_level level)
+{
+    if (level < TLOG_DEBUG || level >= TLOG_END)
+    {
+        return;
+    }
+
+    tlog_ctx.level = level;
+}
+
+int tlog_get_level(void)
+{
+    return tlog_ctx.level;
+}
+
+int tlog_level_from_name(const char *name)
+{
+    for (int i = 0; i < TLOG_END; i++)
+    {
+        if (strcasecmp(name, tlog_level_str[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+const char *tlog_level_name(int level)
+{
+    if (level < TLOG_DEBUG || level >= TLOG_END)
+    {
+        return "UNKNOWN";
+    }
+
+    return tlog_level_str[level];
+}
+
+static void tlog_write(int level, const char *file, int line, const struct timespec *ts, const char *msg)
+{
+    char buff[TLOG_MSG_LEN + 64];
+    struct tm tm;
+    int len = 0;
+
+    switch (tlog_ctx.output)
+    {
+    case TLOG_OUTPUT_SYSLOG:
+        tlog_syslog_write(level, ts, msg);
+        break;
+    case TLOG_OUTPUT_FILE:
+        localtime_r(&ts->tv_sec, &tm);
+        len = snprintf(buff, sizeof(buff), "[%04d-%02d-%02d %02d:%02d:%02d.%03ld][%6s][%s:%d] %s\n", tm.tm_year + 1900,
+                       tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, ts->tv_nsec / 1000000,
+                       tlog_level_str[level], file, line, msg);
+        if (len > (int)sizeof(buff) - 1)
+        {
+            len = sizeof(buff) - 1;
+        }
+
+        if (write(tlog_ctx.fd, buff, len) < 0)
+        {
+            break;
+        }
+        break;
+    default:
+        fprintf(level >= TLOG_WARN ? stderr : stdout, "%s\n", msg);
+        fflush(level >= TLOG_WARN ? stderr : stdout);
+        break;
+    }
+}
+
+static int tlog_ring_put(int level, const char *file, int line, const char *format, va_list ap)
+{
+    unsigned int pos = atomic_load_explicit(&tlog_ctx.tail, memory_order_relaxed);
+    struct tlog_slot *slot = NULL;
+
+    for (;;)
+    {
+        slot = &tlog_ctx.ring[pos % TLOG_RING_SIZE];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int diff = (int)(seq - pos);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&tlog_ctx.tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            atomic_fetch_add_explicit(&tlog_ctx.dropped, 1, memory_order_relaxed);
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&tlog_ctx.tail, memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->file = file;
+    slot->line = line;
+    clock_gettime(CLOCK_REALTIME, &slot->ts);
+    vsnprintf(slot->msg, TLOG_MSG_LEN, format, ap);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    if (atomic_load(&tlog_ctx.waiting))
+    {
+        sem_post(&tlog_ctx.sem);
+    }
+
+    return 0;
+}
+
+static int tlog_ring_drain(void)
+{
+    int count = 0;
+
+    for (;;)
+    {
+        struct tlog_slot *slot = &tlog_ctx.ring[tlog_ctx.head % TLOG_RING_SIZE];
+        unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != tlog_ctx.head + 1)
+        {
+            break;
+        }
+
+        tlog_write(slot->level, slot->file, slot->line, &slot->ts, slot->msg);
+        atomic_store_explicit(&slot->seq, tlog_ctx.head + TLOG_RING_SIZE, memory_order_release);
+        tlog_ctx.head++;
+        count++;
+    }
+
+    unsigned int dropped = atomic_exchange(&tlog_ctx.dropped, 0);
+    if (dropped > 0)
+    {
+        char msg[64];
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        snprintf(msg, sizeof(msg), "%u log messages dropped", dropped);
+        tlog_write(TLOG_WARN, __FILE__, __LINE__, &ts, msg);
+    }
+
+    return count;
+}
+
+static void *tlog_worker(void *arg)
+{
+    while (atomic_load(&tlog_ctx.run))
+    {
+        if (tlog_ring_drain() > 0)
+        {
+            continue;
+        }
+
+        atomic_store(&tlog_ctx.waiting, 1);
+        if (tlog_ring_drain() == 0 && atomic_load(&tlog_ctx.run))
+        {
+            sem_wait(&tlog_ctx.sem);
+        }
+        atomic_store(&tlog_ctx.waiting, 0);
+    }
+
+    tlog_ring_drain();
+    return NULL;
+}
+
+int tlog_start(void)
+{
+    pthread_attr_t attr;
+    size_t stack_size = TLOG_THREAD_STACK_SIZE;
+
+    if (atomic_load(&tlog_ctx.async))
+    {
+        return 0;
+    }
+
+    if (stack_size < PTHREAD_STACK_MIN)
+    {
+        stack_size = PTHREAD_STACK_MIN;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    atomic_store(&tlog_ctx.run, 1);
+    if (pthread_create(&tlog_ctx.tid, &attr, tlog_worker, NULL) != 0)
+    {
+        pthread_attr_destroy(&attr);
+        atomic_store(&tlog_ctx.run, 0);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    atomic_store(&tlog_ctx.async, 1);
+    return 0;
+}
+
+void tlog_exit(void)
+{
+    if (atomic_load(&tlog_ctx.async))
+    {
+        atomic_store(&tlog_ctx.run, 0);
+        sem_post(&tlog_ctx.sem);
+        pthread_join(tlog_ctx.tid, NULL);
+        atomic_store(&tlog_ctx.async, 0);
+    }
+
+    if (tlog_ctx.fd >= 0)
+    {
+        close(tlog_ctx.fd);
+        tlog_ctx.fd = -1;
+    }
+
+    if (tlog_ctx.syslog_fd >= 0)
+    {
+        close(tlog_ctx.syslog_fd);
+        tlog_ctx.syslog_fd = -1;
+    }
+}
+
+int tlog_ratelimit_check(struct tlog_ratelimit *rl, int *suppressed)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long long now = (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    *suppressed = 0;
+    if (rl->window_ms == 0 || now - rl->window_ms >= TLOG_RATELIMIT_INTERVAL)
+    {
+        *suppressed = rl->suppressed;
+        rl->window_ms = now;
+        rl->count = 0;
+        rl->suppressed = 0;
+    }
+
+    if (rl->count >= TLOG_RATELIMIT_BURST)
+    {
+        rl->suppressed++;
+        return 0;
+    }
+
+    rl->count++;
+    return 1;
+}
+
+void tlog_printf(tlog_level level, const char *file, int line, const char *format, ...)
+{
+    va_list ap;
+
+    if (level < tlog_ctx.level || level >= TLOG_END)
+    {
+        return;
+    }
+
+    va_start(ap, format);
+    if (atomic_load(&tlog_ctx.async))
+    {
+        tlog_ring_put(level, file, line, format, ap);
+    }
+    else
+    {
+        char msg[TLOG_MSG_LEN];
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        vsnprintf(msg, sizeof(msg), format, ap);
+        tlog_write(level, file, line, &ts, msg);
+    }
+    va_end(ap);
+}
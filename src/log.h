@@ -0,0 +1,108 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _FAN_LOG_H_
+#define _FAN_LOG_H_
+
+#include <stdio.h>
+
+/*
+ * Logging with levels and three sinks: console, syslog (journald picks it up)
+ * and a plain file. Until tlog_start() is called messages are written
+ * synchronously. Afterwards tlog() only formats the message into a slot of a
+ * lock-free ring and returns; a background thread adds the timestamp and does
+ * the write, so a slow sink never stalls the caller. When the ring is full
+ * messages are dropped and counted instead of blocking.
+ */
+
+typedef enum
+{
+    TLOG_DEBUG = 0,
+    TLOG_INFO = 1,
+    TLOG_NOTICE = 2,
+    TLOG_WARN = 3,
+    TLOG_ERROR = 4,
+    TLOG_FATAL = 5,
+    TLOG_END = 6
+} tlog_level;
+
+typedef enum
+{
+    TLOG_OUTPUT_CONSOLE = 0,
+    TLOG_OUTPUT_SYSLOG = 1,
+    TLOG_OUTPUT_FILE = 2,
+} tlog_output;
+
+struct tlog_ratelimit
+{
+    unsigned long long window_ms;
+    int count;
+    int suppressed;
+};
+
+/* at most TLOG_RATELIMIT_BURST messages per call site every TLOG_RATELIMIT_INTERVAL ms */
+#define TLOG_RATELIMIT_INTERVAL 10000
+#define TLOG_RATELIMIT_BURST 5
+
+#define tlog(level, format, ...) tlog_printf(level, __FILE__, __LINE__, format, ##__VA_ARGS__)
+
+#define tlog_ratelimit(level, format, ...)                                                                            \
+    do                                                                                                                \
+    {                                                                                                                 \
+        static struct tlog_ratelimit _tlog_rl;                                                                        \
+        int _tlog_suppressed = 0;                                                                                     \
+        if (tlog_ratelimit_check(&_tlog_rl, &_tlog_suppressed))                                                       \
+        {                                                                                                             \
+            if (_tlog_suppressed > 0)                                                                                 \
+            {                                                                                                         \
+                tlog(level, "%d similar messages suppressed", _tlog_suppressed);                                      \
+            }                                                                                                         \
+            tlog(level, format, ##__VA_ARGS__);                                                                       \
+        }                                                                                                             \
+    } while (0)
+
+int tlog_init(void);
+
+int tlog_set_output(tlog_output output, const char *file);
+
+void tlog_set_level(tlog_level level);
+
+int tlog_get_level(void);
+
+int tlog_level_from_name(const char *name);
+
+const char *tlog_level_name(int level);
+
+/* switch to asynchronous logging, must be called after daemon() */
+int tlog_start(void);
+
+/* flush pending messages and stop the log thread */
+void tlog_exit(void);
+
+int tlog_ratelimit_check(struct tlog_ratelimit *rl, int *suppressed);
+
+void tlog_printf(tlog_level level, const char *file, int line, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#endif
@@ -0,0 +1,118 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _STATUS_PAGE_H_
+#define _STATUS_PAGE_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Live state of the daemon, published in a small file under /run that
+ * readers mmap. The daemon is the only writer and updates the page under a
+ * seqlock: seq is odd while an update is in progress, so readers copy the
+ * page and retry until they saw the same even seq before and after the
+ * copy. Readers never make a syscall into the daemon nor take a lock.
+ */
+
+#define STATUS_PAGE_MAGIC 0x54534346 /* "FCST" */
+#define STATUS_PAGE_VERSION 2
+#define STATUS_PAGE_SENSORS 8
+#define STATUS_PAGE_NAME_LEN 64
+#define STATUS_PAGE_NO_VALUE INT32_MIN
+
+struct status_page_sensor
+{
+    char name[STATUS_PAGE_NAME_LEN];
+    int32_t temperature; /* millidegrees, STATUS_PAGE_NO_VALUE if not valid */
+    int32_t offset;      /* degrees */
+};
+
+struct status_page_fan
+{
+    int32_t speed;   /* temp-map level */
+    int32_t percent; /* duty, share of maximum */
+    int32_t duty;    /* raw duty written to the controller */
+    int32_t rpm;     /* STATUS_PAGE_NO_VALUE without a tachometer */
+};
+
+struct status_page
+{
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint32_t seq;
+    int32_t pid;
+    uint64_t update_ms; /* CLOCK_MONOTONIC */
+    uint64_t updates;
+    int32_t temperature; /* control temperature, millidegrees */
+    int32_t hysteresis_count;
+    uint32_t fault_flags;
+    int32_t throttled;
+    uint64_t throttle_ms;
+    int32_t passive_level;
+    int32_t control_mode;
+    uint32_t deadline_streak; /* ticks in a row that missed their deadline */
+    uint64_t deadline_misses;
+    uint32_t watchdog_trips; /* times the watchdog thread forced the safe duty */
+    uint32_t sensor_num;
+    uint32_t fan_num;
+    struct status_page_sensor sensor[STATUS_PAGE_SENSORS];
+    struct status_page_fan fan[1];
+};
+
+static inline void status_page_write_begin(struct status_page *page)
+{
+    atomic_fetch_add_explicit(&page->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void status_page_write_end(struct status_page *page)
+{
+    atomic_fetch_add_explicit(&page->seq, 1, memory_order_release);
+}
+
+/* copy a consistent snapshot, returns -1 if the writer kept it busy for all tries */
+static inline int status_page_read(const struct status_page *page, struct status_page *snapshot)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        uint32_t seq = atomic_load_explicit(&page->seq, memory_order_acquire);
+        if (seq & 1)
+        {
+            continue;
+        }
+
+        memcpy(snapshot, (const void *)page, sizeof(*snapshot));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&page->seq, memory_order_relaxed) == seq)
+        {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+#endif
@@ -0,0 +1,365 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "sysfs-read.h"
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+struct sysfs_read_entry
+{
+    int fd;
+    int err;
+    long long value;
+};
+
+#ifdef HAVE_IO_URING
+struct sysfs_uring
+{
+    int fd;
+    unsigned int entries;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct sysfs_read_struct
+{
+    struct sysfs_read_entry entry[SYSFS_READ_MAX];
+    char buff[SYSFS_READ_MAX][SYSFS_READ_BUFF_LEN];
+    int count;
+    int want_uring;
+    int use_uring;
+#ifdef HAVE_IO_URING
+    struct sysfs_uring ring;
+#endif
+};
+
+static struct sysfs_read_struct sysfs_read;
+
+void sysfs_read_init(int use_uring)
+{
+    memset(&sysfs_read, 0, sizeof(sysfs_read));
+    sysfs_read.want_uring = use_uring;
+#ifdef HAVE_IO_URING
+    sysfs_read.ring.fd = -1;
+#endif
+}
+
+int sysfs_read_register(int fd)
+{
+    if (fd < 0 || sysfs_read.count >= SYSFS_READ_MAX || sysfs_read.use_uring)
+    {
+        return -1;
+    }
+
+    struct sysfs_read_entry *entry = &sysfs_read.entry[sysfs_read.count];
+    entry->fd = fd;
+    entry->err = -1;
+    entry->value = 0;
+    return sysfs_read.count++;
+}
+
+static void sysfs_read_parse(int id, int len)
+{
+    struct sysfs_read_entry *entry = &sysfs_read.entry[id];
+
+    if (len <= 0)
+    {
+        entry->err = -1;
+        return;
+    }
+
+    sysfs_read.buff[id][len < SYSFS_READ_BUFF_LEN ? len : SYSFS_READ_BUFF_LEN - 1] = '\0';
+    entry->value = atoll(sysfs_read.buff[id]);
+    entry->err = 0;
+}
+
+static void sysfs_read_pread(const int *ids, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int id = ids ? ids[i] : i;
+        int len = pread(sysfs_read.entry[id].fd, sysfs_read.buff[id], SYSFS_READ_BUFF_LEN - 1, 0);
+        sysfs_read_parse(id, len);
+    }
+}
+
+#ifdef HAVE_IO_URING
+static int sysfs_uring_setup(unsigned int entries)
+{
+    struct sysfs_uring *ring = &sysfs_read.ring;
+    struct io_uring_params params;
+    int fds[SYSFS_READ_MAX];
+    struct iovec iov;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        goto errout;
+    }
+
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED)
+    {
+        goto errout;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        goto errout;
+    }
+
+    ring->sq_head = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+
+    for (int i = 0; i < sysfs_read.count; i++)
+    {
+        fds[i] = sysfs_read.entry[i].fd;
+    }
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, sysfs_read.count) < 0)
+    {
+        goto errout;
+    }
+
+    /* one registered buffer holds the read slots of every file */
+    iov.iov_base = sysfs_read.buff;
+    iov.iov_len = sizeof(sysfs_read.buff);
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+    {
+        goto errout;
+    }
+
+    return 0;
+
+errout:
+    sysfs_read_exit();
+    return -1;
+}
+
+static int sysfs_uring_batch(const int *ids, int count)
+{
+    struct sysfs_uring *ring = &sysfs_read.ring;
+    unsigned int tail = *ring->sq_tail;
+    int submitted = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        int id = ids ? ids[i] : i;
+        unsigned int index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = id;
+        sqe->addr = (unsigned long)sysfs_read.buff[id];
+        sqe->len = SYSFS_READ_BUFF_LEN - 1;
+        sqe->off = 0;
+        sqe->buf_index = 0;
+        sqe->user_data = id;
+        ring->sq_array[index] = index;
+        tail++;
+    }
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (submitted < count)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted, count - submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        submitted += ret;
+    }
+
+    int reaped = 0;
+    while (reaped < count)
+    {
+        unsigned int head = *ring->cq_head;
+        unsigned int cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == cq_tail)
+        {
+            if (syscall(__NR_io_uring_enter, ring->fd, 0, count - reaped, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        for (; head != cq_tail; head++, reaped++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < (unsigned long long)sysfs_read.count)
+            {
+                sysfs_read_parse((int)cqe->user_data, cqe->res);
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+#endif
+
+int sysfs_read_start(void)
+{
+    if (!sysfs_read.want_uring || sysfs_read.count == 0)
+    {
+        return 0;
+    }
+
+#ifdef HAVE_IO_URING
+    if (sysfs_uring_setup(SYSFS_READ_MAX) == 0)
+    {
+        sysfs_read.use_uring = 1;
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+int sysfs_read_batch(const int *ids, int count)
+{
+    if (ids == NULL)
+    {
+        count = sysfs_read.count;
+    }
+
+    if (count <= 0)
+    {
+        return 0;
+    }
+
+#ifdef HAVE_IO_URING
+    if (sysfs_read.use_uring)
+    {
+        if (sysfs_uring_batch(ids, count) == 0)
+        {
+            return 0;
+        }
+
+        /* a broken ring should not cost us the sensors */
+        sysfs_read_exit();
+    }
+#endif
+
+    sysfs_read_pread(ids, count);
+    return 0;
+}
+
+int sysfs_read_value(int id, long long *value)
+{
+    if (id < 0 || id >= sysfs_read.count || sysfs_read.entry[id].err != 0)
+    {
+        return -1;
+    }
+
+    *value = sysfs_read.entry[id].value;
+    return 0;
+}
+
+const char *sysfs_read_backend(void)
+{
+    return sysfs_read.use_uring ? "io_uring" : "pread";
+}
+
+void sysfs_read_exit(void)
+{
+#ifdef HAVE_IO_URING
+    struct sysfs_uring *ring = &sysfs_read.ring;
+
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED)
+    {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+    {
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+#endif
+    sysfs_read.use_uring = 0;
+}
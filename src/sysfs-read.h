@@ -0,0 +1,62 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _SYSFS_READ_H_
+#define _SYSFS_READ_H_
+
+/*
+ * Batched reads of small sysfs attributes (temperatures, frequencies, fan
+ * tachometers), each holding one integer. Every registered file is read from
+ * offset 0 each time it is sampled. With the io_uring backend all requested
+ * reads of a tick go to the kernel in a single io_uring_enter() using fixed
+ * files and one registered buffer; otherwise, or when io_uring is not
+ * available, every file costs one pread().
+ */
+
+#ifndef SYSFS_READ_MAX
+#define SYSFS_READ_MAX 64
+#endif
+
+#define SYSFS_READ_BUFF_LEN 32
+
+/* use_uring: try io_uring first, fall back to pread */
+void sysfs_read_init(int use_uring);
+
+/* register an open fd, returns the handle or -1 if the table is full */
+int sysfs_read_register(int fd);
+
+/* call once after all files are registered */
+int sysfs_read_start(void);
+
+/* read the given handles, or every registered handle if ids is NULL */
+int sysfs_read_batch(const int *ids, int count);
+
+/* value of the last read of a handle, -1 if that read failed */
+int sysfs_read_value(int id, long long *value);
+
+const char *sysfs_read_backend(void);
+
+void sysfs_read_exit(void);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <string.h>
+#include "thermal-model.h"
+
+#define THERMAL_MODEL_LAMBDA 0.999
+#define THERMAL_MODEL_P0 1000.0
+
+void thermal_model_init(struct thermal_model *model, double ambient)
+{
+    memset(model, 0, sizeof(*model));
+    model->lambda = THERMAL_MODEL_LAMBDA;
+    model->ambient = ambient;
+    for (int i = 0; i < THERMAL_MODEL_PARAMS; i++)
+    {
+        model->p[i][i] = THERMAL_MODEL_P0;
+    }
+}
+
+void thermal_model_set(struct thermal_model *model, double heat, double cool, double cool_duty, unsigned long samples)
+{
+    model->theta[THERMAL_MODEL_HEAT] = heat;
+    model->theta[THERMAL_MODEL_COOL] = cool;
+    model->theta[THERMAL_MODEL_COOL_DUTY] = cool_duty;
+    model->samples = samples;
+
+    /* trust restored parameters, but keep them open for correction */
+    memset(model->p, 0, sizeof(model->p));
+    for (int i = 0; i < THERMAL_MODEL_PARAMS; i++)
+    {
+        model->p[i][i] = 1.0;
+    }
+}
+
+void thermal_model_update(struct thermal_model *model, double last_temp, double temp, double duty, double dt)
+{
+    double phi[THERMAL_MODEL_PARAMS];
+    double pphi[THERMAL_MODEL_PARAMS];
+    double gain[THERMAL_MODEL_PARAMS];
+    double rise = last_temp - model->ambient;
+    double denom = model->lambda;
+    double err = 0;
+    int i = 0;
+    int j = 0;
+
+    if (dt <= 0)
+    {
+        return;
+    }
+
+    phi[THERMAL_MODEL_HEAT] = 1.0;
+    phi[THERMAL_MODEL_COOL] = -rise;
+    phi[THERMAL_MODEL_COOL_DUTY] = -duty * rise;
+
+    for (i = 0; i < THERMAL_MODEL_PARAMS; i++)
+    {
+        pphi[i] = 0;
+        for (j = 0; j < THERMAL_MODEL_PARAMS; j++)
+        {
+            pphi[i] += model->p[i][j] * phi[j];
+        }
+        denom += phi[i] * pphi[i];
+    }
+
+    err = (temp - last_temp) / dt;
+    for (i = 0; i < THERMAL_MODEL_PARAMS; i++)
+    {
+        gain[i] = pphi[i] / denom;
+        err -= phi[i] * model->theta[i];
+    }
+
+    for (i = 0; i < THERMAL_MODEL_PARAMS; i++)
+    {
+        model->theta[i] += gain[i] * err;
+        for (j = 0; j < THERMAL_MODEL_PARAMS; j++)
+        {
+            model->p[i][j] = (model->p[i][j] - gain[i] * pphi[j]) / model->lambda;
+        }
+    }
+
+    model->samples++;
+}
+
+int thermal_model_valid(const struct thermal_model *model)
+{
+    if (model->samples < THERMAL_MODEL_MIN_SAMPLES)
+    {
+        return 0;
+    }
+
+    /* a fan that heats the chip means the fit has not settled yet */
+    if (model->theta[THERMAL_MODEL_COOL] < 0 || model->theta[THERMAL_MODEL_COOL_DUTY] <= 0)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+double thermal_model_heat(const struct thermal_model *model, double last_temp, double temp, double duty, double dt)
+{
+    double cooling = model->theta[THERMAL_MODEL_COOL] + model->theta[THERMAL_MODEL_COOL_DUTY] * duty;
+
+    if (dt <= 0)
+    {
+        return model->theta[THERMAL_MODEL_HEAT];
+    }
+
+    return (temp - last_temp) / dt + cooling * (last_temp - model->ambient);
+}
+
+double thermal_model_predict(const struct thermal_model *model, double temp, double duty, double heat, double dt)
+{
+    double cooling = model->theta[THERMAL_MODEL_COOL] + model->theta[THERMAL_MODEL_COOL_DUTY] * duty;
+    return temp + dt * (heat - cooling * (temp - model->ambient));
+}
+
+double thermal_model_duty(const struct thermal_model *model, double heat, double ceiling)
+{
+    double rise = ceiling - model->ambient;
+
+    if (rise <= 0 || model->theta[THERMAL_MODEL_COOL_DUTY] <= 0)
+    {
+        return 1.0;
+    }
+
+    return (heat / rise - model->theta[THERMAL_MODEL_COOL]) / model->theta[THERMAL_MODEL_COOL_DUTY];
+}
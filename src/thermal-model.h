@@ -0,0 +1,75 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _THERMAL_MODEL_H_
+#define _THERMAL_MODEL_H_
+
+/*
+ * First-order thermal model of the SoC and its enclosure:
+ *
+ *   dT/dt = heat - (cool + cool_duty * duty) * (T - ambient)
+ *
+ * heat is the temperature rise per second caused by the load, cool the passive
+ * cooling coefficient and cool_duty the extra cooling per unit of fan duty
+ * (duty is 0.0 - 1.0). The parameters are fitted online with recursive least
+ * squares and exponential forgetting.
+ */
+
+#define THERMAL_MODEL_HEAT 0
+#define THERMAL_MODEL_COOL 1
+#define THERMAL_MODEL_COOL_DUTY 2
+#define THERMAL_MODEL_PARAMS 3
+
+/* samples needed before the fitted parameters are trusted */
+#define THERMAL_MODEL_MIN_SAMPLES 600
+
+struct thermal_model
+{
+    double theta[THERMAL_MODEL_PARAMS];
+    double p[THERMAL_MODEL_PARAMS][THERMAL_MODEL_PARAMS];
+    double lambda;
+    double ambient;
+    unsigned long samples;
+};
+
+void thermal_model_init(struct thermal_model *model, double ambient);
+
+/* seed the model with previously learned parameters */
+void thermal_model_set(struct thermal_model *model, double heat, double cool, double cool_duty, unsigned long samples);
+
+/* feed one sample: temperature moved from last_temp to temp in dt seconds at duty */
+void thermal_model_update(struct thermal_model *model, double last_temp, double temp, double duty, double dt);
+
+int thermal_model_valid(const struct thermal_model *model);
+
+/* heat input that explains the observed step, with the fitted cooling terms */
+double thermal_model_heat(const struct thermal_model *model, double last_temp, double temp, double duty, double dt);
+
+/* temperature after dt seconds at duty with the given heat input */
+double thermal_model_predict(const struct thermal_model *model, double temp, double duty, double heat, double dt);
+
+/* duty that holds the steady state temperature at ceiling with the given heat input, not clamped */
+double thermal_model_duty(const struct thermal_model *model, double heat, double ceiling);
+
+#endif
@@ -0,0 +1,383 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Round-trip check of the tiny-json writer, whose output is read back by the
+ * service from its state files. Every document is written, parsed again with
+ * json_create() and compared with what was written: escaping, int64 and
+ * double extremes, nesting, pretty and compact layout, the nesting and
+ * overflow errors, and the fd mode.
+ *
+ *   make -C src check
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../lib/tiny-json.h"
+
+#define MAX_FIELDS 256
+
+int failures = 0;
+
+void check(int ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static const char *texts[] = {
+    "",
+    "plain",
+    "quote \" backslash \\ slash /",
+    "\b\f\n\r\t",
+    "\x01\x02\x1f control",
+    "utf-8 \xc3\xa9\xe2\x82\xac",
+    "ends with backslash \\",
+};
+
+static const int64_t integers[] = {0, 1, -1, 255, INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN, INT64_MIN + 1};
+
+static const double reals[] = {0.0, 1.0, -1.5, 0.1, 1.0 / 3, 1e21, 1e-7, 1e300, -2.2250738585072014e-308, 4.9e-324, 1.7976931348623157e308};
+
+#define ARRAY_SIZE(a) ((int)(sizeof(a) / sizeof(a[0])))
+
+int write_document(jsonWriter_t *writer)
+{
+    char name[32];
+
+    json_writeObjOpen(writer, NULL);
+    json_writeArrOpen(writer, "texts");
+    for (int i = 0; i < ARRAY_SIZE(texts); i++)
+    {
+        json_writeText(writer, NULL, texts[i]);
+    }
+    json_writeArrClose(writer);
+
+    /* escaped names too */
+    json_writeObjOpen(writer, "names");
+    for (int i = 0; i < ARRAY_SIZE(texts); i++)
+    {
+        json_writeInteger(writer, texts[i], i);
+    }
+    json_writeObjClose(writer);
+
+    json_writeObjOpen(writer, "integers");
+    for (int i = 0; i < ARRAY_SIZE(integers); i++)
+    {
+        snprintf(name, sizeof(name), "i%d", i);
+        json_writeInteger(writer, name, integers[i]);
+    }
+    json_writeObjClose(writer);
+
+    json_writeArrOpen(writer, "reals");
+    for (int i = 0; i < ARRAY_SIZE(reals); i++)
+    {
+        json_writeReal(writer, NULL, reals[i]);
+    }
+    json_writeArrClose(writer);
+
+    json_writeArrOpen(writer, "special");
+    json_writeReal(writer, NULL, NAN);
+    json_writeReal(writer, NULL, INFINITY);
+    json_writeBoolean(writer, NULL, true);
+    json_writeBoolean(writer, NULL, false);
+    json_writeNull(writer, NULL);
+    json_writeArrOpen(writer, NULL);
+    json_writeArrClose(writer);
+    json_writeObjOpen(writer, NULL);
+    json_writeObjClose(writer);
+    json_writeArrClose(writer);
+
+    json_writeObjOpen(writer, "nested");
+    json_writeArrOpen(writer, "levels");
+    for (int i = 0; i < 3; i++)
+    {
+        json_writeObjOpen(writer, NULL);
+        json_writeInteger(writer, "level", i);
+        json_writeArrOpen(writer, "deep");
+        json_writeArrOpen(writer, NULL);
+        json_writeInteger(writer, NULL, i * 10);
+        json_writeArrClose(writer);
+        json_writeArrClose(writer);
+        json_writeObjClose(writer);
+    }
+    json_writeArrClose(writer);
+    json_writeObjClose(writer);
+    json_writeObjClose(writer);
+
+    return json_writerEnd(writer);
+}
+
+void verify_document(char *str, const char *mode)
+{
+    json_t pool[MAX_FIELDS];
+    char what[128];
+    char name[32];
+
+    json_t const *root = json_create(str, pool, MAX_FIELDS);
+    snprintf(what, sizeof(what), "%s: parse back", mode);
+    check(root != NULL, what);
+    if (root == NULL)
+    {
+        return;
+    }
+
+    json_t const *field = json_getChild(json_getProperty(root, "texts"));
+    for (int i = 0; i < ARRAY_SIZE(texts); i++, field = json_getSibling(field))
+    {
+        snprintf(what, sizeof(what), "%s: text %d", mode, i);
+        check(field != NULL && json_getType(field) == JSON_TEXT && strcmp(json_getValue(field), texts[i]) == 0, what);
+        if (field == NULL)
+        {
+            return;
+        }
+    }
+
+    json_t const *names = json_getProperty(root, "names");
+    for (int i = 0; i < ARRAY_SIZE(texts); i++)
+    {
+        field = json_getProperty(names, texts[i]);
+        snprintf(what, sizeof(what), "%s: name %d", mode, i);
+        check(field != NULL && json_getType(field) == JSON_INTEGER && json_getInteger(field) == i, what);
+    }
+
+    json_t const *integers_obj = json_getProperty(root, "integers");
+    for (int i = 0; i < ARRAY_SIZE(integers); i++)
+    {
+        snprintf(name, sizeof(name), "i%d", i);
+        field = json_getProperty(integers_obj, name);
+        snprintf(what, sizeof(what), "%s: integer %lld", mode, (long long)integers[i]);
+        check(field != NULL && json_getType(field) == JSON_INTEGER && json_getInteger(field) == integers[i], what);
+    }
+
+    field = json_getChild(json_getProperty(root, "reals"));
+    for (int i = 0; i < ARRAY_SIZE(reals); i++, field = json_getSibling(field))
+    {
+        snprintf(what, sizeof(what), "%s: real %.17g", mode, reals[i]);
+        check(field != NULL && json_getType(field) == JSON_REAL && json_getReal(field) == reals[i], what);
+        if (field == NULL)
+        {
+            return;
+        }
+    }
+
+    static const jsonType_t special[] = {JSON_NULL, JSON_NULL, JSON_BOOLEAN, JSON_BOOLEAN, JSON_NULL, JSON_ARRAY, JSON_OBJ};
+    field = json_getChild(json_getProperty(root, "special"));
+    for (int i = 0; i < ARRAY_SIZE(special); i++, field = json_getSibling(field))
+    {
+        snprintf(what, sizeof(what), "%s: special %d", mode, i);
+        check(field != NULL && json_getType(field) == special[i], what);
+        if (field == NULL)
+        {
+            return;
+        }
+    }
+
+    field = json_getChild(json_getProperty(json_getProperty(root, "nested"), "levels"));
+    for (int i = 0; i < 3; i++, field = json_getSibling(field))
+    {
+        json_t const *deep = field ? json_getChild(json_getChild(json_getProperty(field, "deep"))) : NULL;
+        snprintf(what, sizeof(what), "%s: nested level %d", mode, i);
+        check(deep != NULL && json_getInteger(json_getProperty(field, "level")) == i && json_getInteger(deep) == i * 10, what);
+        if (field == NULL)
+        {
+            return;
+        }
+    }
+}
+
+void check_round_trip(void)
+{
+    char buff[4096];
+    jsonWriter_t writer;
+
+    for (int pretty = 0; pretty <= 1; pretty++)
+    {
+        json_writerInit(&writer, buff, sizeof(buff), pretty);
+        int len = write_document(&writer);
+        check(len > 0 && len == (int)strlen(buff), pretty ? "pretty: length" : "compact: length");
+        verify_document(buff, pretty ? "pretty" : "compact");
+    }
+}
+
+/* every prefix size of the buffer must fail cleanly, with a terminated string */
+void check_overflow(void)
+{
+    char full[4096];
+    char buff[4096];
+    jsonWriter_t writer;
+
+    json_writerInit(&writer, full, sizeof(full), false);
+    int len = write_document(&writer);
+    for (int size = 1; size <= len; size++)
+    {
+        memset(buff, 'x', sizeof(buff));
+        json_writerInit(&writer, buff, size, false);
+        int ret = write_document(&writer);
+        if (ret != -1 || buff[size - 1] != '\0' || buff[size] != 'x' || strncmp(buff, full, size - 1) != 0)
+        {
+            check(0, "overflow truncation");
+            break;
+        }
+    }
+
+    json_writerInit(&writer, buff, len + 1, false);
+    check(write_document(&writer) == len && strcmp(buff, full) == 0, "exact buffer size");
+}
+
+void check_nesting_errors(void)
+{
+    char buff[256];
+    jsonWriter_t writer;
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    check(json_writerEnd(&writer) == -1, "empty document");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    json_writeObjOpen(&writer, NULL);
+    check(json_writerEnd(&writer) == -1, "unclosed object");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    json_writeObjOpen(&writer, NULL);
+    json_writeObjClose(&writer);
+    json_writeObjClose(&writer);
+    check(json_writerEnd(&writer) == -1, "extra close");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    json_writeObjOpen(&writer, NULL);
+    json_writeArrClose(&writer);
+    check(json_writerEnd(&writer) == -1, "object closed as array");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    json_writeArrOpen(&writer, NULL);
+    json_writeObjClose(&writer);
+    check(json_writerEnd(&writer) == -1, "array closed as object");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    json_writeObjOpen(&writer, NULL);
+    json_writeInteger(&writer, NULL, 1);
+    json_writeObjClose(&writer);
+    check(json_writerEnd(&writer) == -1, "unnamed property");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    json_writeArrOpen(&writer, NULL);
+    json_writeInteger(&writer, "a", 1);
+    json_writeArrClose(&writer);
+    check(json_writerEnd(&writer) == -1, "named element");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    json_writeObjOpen(&writer, "root");
+    json_writeObjClose(&writer);
+    check(json_writerEnd(&writer) == -1, "named root");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    json_writeObjOpen(&writer, NULL);
+    json_writeObjClose(&writer);
+    json_writeObjOpen(&writer, NULL);
+    json_writeObjClose(&writer);
+    check(json_writerEnd(&writer) == -1, "two roots");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    for (int i = 0; i <= JSON_WRITER_MAX_DEPTH; i++)
+    {
+        json_writeArrOpen(&writer, NULL);
+    }
+    for (int i = 0; i <= JSON_WRITER_MAX_DEPTH; i++)
+    {
+        json_writeArrClose(&writer);
+    }
+    check(json_writerEnd(&writer) == -1, "too deep");
+
+    json_writerInit(&writer, buff, sizeof(buff), false);
+    for (int i = 0; i < JSON_WRITER_MAX_DEPTH; i++)
+    {
+        json_writeArrOpen(&writer, NULL);
+    }
+    for (int i = 0; i < JSON_WRITER_MAX_DEPTH; i++)
+    {
+        json_writeArrClose(&writer);
+    }
+    check(json_writerEnd(&writer) == JSON_WRITER_MAX_DEPTH * 2, "maximum depth");
+}
+
+/* a staging buffer much smaller than the document, flushed many times */
+void check_fd(void)
+{
+    char file[] = "/tmp/json-check-XXXXXX";
+    char stage[7];
+    char buff[4096];
+    char full[4096];
+    jsonWriter_t writer;
+
+    int fd = mkstemp(file);
+    check(fd >= 0, "fd: temporary file");
+    if (fd < 0)
+    {
+        return;
+    }
+    unlink(file);
+
+    json_writerInitFd(&writer, fd, stage, sizeof(stage), true);
+    int len = write_document(&writer);
+    json_writerInit(&writer, full, sizeof(full), true);
+    check(len > 0 && len == write_document(&writer), "fd: length");
+
+    int got = pread(fd, buff, sizeof(buff) - 1, 0);
+    close(fd);
+    check(got == len, "fd: written");
+    if (got != len)
+    {
+        return;
+    }
+
+    buff[got] = '\0';
+    check(strcmp(buff, full) == 0, "fd: same text as the buffer mode");
+    verify_document(buff, "fd");
+}
+
+int main(void)
+{
+    check_round_trip();
+    check_overflow();
+    check_nesting_errors();
+    check_fd();
+
+    if (failures > 0)
+    {
+        printf("%d checks failed.\n", failures);
+        return 1;
+    }
+
+    printf("json writer: all checks passed.\n");
+    return 0;
+}
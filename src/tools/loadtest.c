@@ -0,0 +1,597 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * Load-test harness for fan-control.
+ *
+ * Builds a fake sysfs tree (thermal zone, pwm-fan hwmon, one cpufreq policy),
+ * starts the daemon on it with --sysfs-root, steps the temperature through a
+ * script and, optionally, loads every core with cpu, memory and io workers.
+ * The fan pwm1 attribute is a FIFO, so every duty write is seen the moment it
+ * happens. At the end it reports the daemon's cpu time per hour, wakeups per
+ * second, RSS and the latency from an upward threshold crossing to the duty
+ * write.
+ *
+ *   make -C src loadtest
+ *   src/tools/loadtest -d src/fan-control -t 300 -l cpu,mem,io
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_WORKERS 256
+#define MAX_SAMPLES 4096
+#define MAX_SCRIPT_STEPS 64
+
+struct script_step
+{
+    int temp;
+    int seconds;
+};
+
+/* same thresholds as the temp-map written to the test config */
+static const int level_temp[] = {40, 44, 49, 54, 59, 64, 67};
+static const int level_duty[] = {0, 55, 60, 70, 80, 90, 100};
+#define LEVEL_NUM ((int)(sizeof(level_temp) / sizeof(level_temp[0])))
+
+struct script_step script[MAX_SCRIPT_STEPS] = {{38, 5}, {50, 5}, {62, 5}, {69, 5}, {45, 20}};
+int script_num = 5;
+char root[200];
+char daemon_path[1024] = "./fan-control";
+int duration = 60;
+int interval_ms = 1000;
+int load_cpu = 0;
+int load_mem = 0;
+int load_io = 0;
+pid_t workers[MAX_WORKERS];
+int worker_num = 0;
+double latency_ms[MAX_SAMPLES];
+int latency_num = 0;
+
+unsigned long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int make_dirs(const char *path)
+{
+    char buff[1024];
+    strncpy(buff, path, sizeof(buff) - 1);
+    buff[sizeof(buff) - 1] = '\0';
+    for (char *p = buff + 1; *p; p++)
+    {
+        if (*p == '/')
+        {
+            *p = '\0';
+            if (mkdir(buff, 0755) != 0 && errno != EEXIST)
+            {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+
+    return (mkdir(buff, 0755) != 0 && errno != EEXIST) ? -1 : 0;
+}
+
+int write_file(const char *dir, const char *name, const char *value)
+{
+    char file[1024];
+    snprintf(file, sizeof(file), "%s/%s", dir, name);
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int ret = write(fd, value, strlen(value)) < 0 ? -1 : 0;
+    close(fd);
+    return ret;
+}
+
+int setup_root(void)
+{
+    char dir[1024];
+    char conf[4096];
+    int len = 0;
+
+    snprintf(dir, sizeof(dir), "%s/sys/class/thermal/thermal_zone0", root);
+    if (make_dirs(dir) != 0 || write_file(dir, "temp", "40000     \n") != 0 || write_file(dir, "policy", "step_wise\n") != 0 ||
+        write_file(dir, "mode", "enabled\n") != 0)
+    {
+        return -1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/sys/devices/platform/pwm-fan/hwmon/hwmon0", root);
+    if (make_dirs(dir) != 0)
+    {
+        return -1;
+    }
+
+    strncat(dir, "/pwm1", sizeof(dir) - strlen(dir) - 1);
+    if (mkfifo(dir, 0644) != 0)
+    {
+        return -1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/sys/devices/system/cpu/cpufreq/policy0", root);
+    if (make_dirs(dir) != 0 || write_file(dir, "scaling_cur_freq", "1800000\n") != 0 ||
+        write_file(dir, "cpuinfo_cur_freq", "1800000\n") != 0 || write_file(dir, "scaling_max_freq", "1800000\n") != 0 ||
+        write_file(dir, "cpuinfo_min_freq", "600000\n") != 0)
+    {
+        return -1;
+    }
+
+    len += snprintf(conf + len, sizeof(conf) - len,
+                    "{\n"
+                    "    \"interval\": %d,\n"
+                    "    \"log\": {\"level\": \"notice\", \"output\": \"file\", \"file\": \"%s/fan-control.log\"},\n"
+                    "    \"status-file\": \"%s/fan-control.status\",\n"
+                    "    \"calibration-file\": \"%s/fan-calibration.json\",\n"
+                    "    \"handover\": {\"state-file\": \"%s/fan-control.state\"},\n"
+                    "    \"temp-map\": [\n",
+                    interval_ms, root, root, root, root);
+    for (int i = 0; i < LEVEL_NUM; i++)
+    {
+        len += snprintf(conf + len, sizeof(conf) - len, "        {\"temp\": %d, \"duty\": %d, \"duration\": 20}%s\n", level_temp[i],
+                        level_duty[i], i < LEVEL_NUM - 1 ? "," : "");
+    }
+    len += snprintf(conf + len, sizeof(conf) - len, "    ]\n}\n");
+
+    return write_file(root, "fan-control.json", conf);
+}
+
+int level_of(int temp)
+{
+    for (int i = LEVEL_NUM - 1; i >= 0; i--)
+    {
+        if (temp > level_temp[i])
+        {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+void worker_cpu(void)
+{
+    volatile unsigned long x = 0;
+    while (1)
+    {
+        x++;
+    }
+}
+
+void worker_mem(void)
+{
+    size_t size = 64 * 1024 * 1024;
+    char *buff = malloc(size);
+    if (buff == NULL)
+    {
+        _exit(1);
+    }
+
+    while (1)
+    {
+        for (size_t i = 0; i < size; i += 4096)
+        {
+            buff[i]++;
+        }
+    }
+}
+
+void worker_io(int id)
+{
+    char file[1024];
+    char buff[65536];
+
+    memset(buff, id, sizeof(buff));
+    snprintf(file, sizeof(file), "%s/io-%d", root, id);
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        _exit(1);
+    }
+
+    while (1)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            if (pwrite(fd, buff, sizeof(buff), (off_t)i * sizeof(buff)) < 0)
+            {
+                _exit(1);
+            }
+        }
+        fsync(fd);
+    }
+}
+
+void start_workers(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int kinds[3] = {load_cpu, load_mem, load_io};
+
+    for (int k = 0; k < 3; k++)
+    {
+        for (long i = 0; kinds[k] && i < cpus && worker_num < MAX_WORKERS; i++)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                if (k == 0)
+                {
+                    worker_cpu();
+                }
+                else if (k == 1)
+                {
+                    worker_mem();
+                }
+                worker_io((int)i);
+            }
+
+            if (pid > 0)
+            {
+                workers[worker_num++] = pid;
+            }
+        }
+    }
+}
+
+void stop_workers(void)
+{
+    for (int i = 0; i < worker_num; i++)
+    {
+        kill(workers[i], SIGKILL);
+        waitpid(workers[i], NULL, 0);
+    }
+}
+
+/* utime + stime in clock ticks and context switches of every thread of pid */
+int read_proc_usage(pid_t pid, unsigned long long *ticks, unsigned long long *voluntary, unsigned long long *involuntary,
+                    long *rss_kb, long *hwm_kb)
+{
+    char file[512];
+    char line[1024];
+
+    snprintf(file, sizeof(file), "/proc/%d/stat", pid);
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    unsigned long utime = 0;
+    unsigned long stime = 0;
+    if (fgets(line, sizeof(line), fp) != NULL)
+    {
+        /* the fields after the command name, which may contain spaces */
+        char *p = strrchr(line, ')');
+        if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    *ticks = utime + stime;
+
+    *voluntary = 0;
+    *involuntary = 0;
+    snprintf(file, sizeof(file), "/proc/%d/task", pid);
+    DIR *dir = opendir(file);
+    struct dirent *ent = NULL;
+    while (dir != NULL && (ent = readdir(dir)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        snprintf(file, sizeof(file), "/proc/%d/task/%s/status", pid, ent->d_name);
+        fp = fopen(file, "r");
+        while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+        {
+            unsigned long long v = 0;
+            if (sscanf(line, "voluntary_ctxt_switches: %llu", &v) == 1)
+            {
+                *voluntary += v;
+            }
+            else if (sscanf(line, "nonvoluntary_ctxt_switches: %llu", &v) == 1)
+            {
+                *involuntary += v;
+            }
+        }
+
+        if (fp != NULL)
+        {
+            fclose(fp);
+        }
+    }
+
+    if (dir != NULL)
+    {
+        closedir(dir);
+    }
+
+    snprintf(file, sizeof(file), "/proc/%d/status", pid);
+    fp = fopen(file, "r");
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+    {
+        sscanf(line, "VmRSS: %ld", rss_kb);
+        sscanf(line, "VmHWM: %ld", hwm_kb);
+    }
+
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+
+    return 0;
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(double p)
+{
+    int i = (int)(p / 100 * (latency_num - 1) + 0.5);
+    return latency_num > 0 ? latency_ms[i] : 0;
+}
+
+int parse_script(const char *str)
+{
+    char buff[1024];
+    char *save = NULL;
+
+    strncpy(buff, str, sizeof(buff) - 1);
+    buff[sizeof(buff) - 1] = '\0';
+    script_num = 0;
+    for (char *tok = strtok_r(buff, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        if (script_num >= MAX_SCRIPT_STEPS || sscanf(tok, "%d:%d", &script[script_num].temp, &script[script_num].seconds) != 2 ||
+            script[script_num].seconds <= 0)
+        {
+            return -1;
+        }
+        script_num++;
+    }
+
+    return script_num > 0 ? 0 : -1;
+}
+
+void show_help(void)
+{
+    printf("fan-control load-test harness.\n"
+           "Usage: loadtest [option]\n"
+           "Options:\n"
+           "  -d [path]      fan-control binary (default: ./fan-control)\n"
+           "  -t [seconds]   test duration (default: 60)\n"
+           "  -i [ms]        daemon sample interval (default: 1000)\n"
+           "  -s [script]    temperature script, degrees:seconds,... repeated (default: 38:5,50:5,62:5,69:5,45:20)\n"
+           "  -l [loads]     contention on every core: cpu,mem,io (default: none)\n"
+           "  -k             keep the fake sysfs tree\n"
+           "  -h             show help message.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int keep = 0;
+    char file[1024];
+    long ticks_per_s = sysconf(_SC_CLK_TCK);
+
+    while ((opt = getopt(argc, argv, "d:t:i:s:l:kh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            strncpy(daemon_path, optarg, sizeof(daemon_path) - 1);
+            break;
+        case 't':
+            duration = atoi(optarg);
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 's':
+            if (parse_script(optarg) != 0)
+            {
+                printf("Invalid script %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            load_cpu = strstr(optarg, "cpu") != NULL;
+            load_mem = strstr(optarg, "mem") != NULL;
+            load_io = strstr(optarg, "io") != NULL;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            show_help();
+            return 1;
+        }
+    }
+
+    if (duration <= 0 || interval_ms <= 0)
+    {
+        show_help();
+        return 1;
+    }
+
+    snprintf(root, sizeof(root), "/tmp/fan-control-loadtest.XXXXXX");
+    if (mkdtemp(root) == NULL || setup_root() != 0)
+    {
+        printf("Failed to create fake sysfs, %s\n", strerror(errno));
+        return 1;
+    }
+
+    /* keep a writer on the FIFO ourselves, so polling never sees a hangup between daemon writes */
+    snprintf(file, sizeof(file), "%s/sys/devices/platform/pwm-fan/hwmon/hwmon0/pwm1", root);
+    int fd_pwm = open(file, O_RDONLY | O_NONBLOCK);
+    int fd_pwm_hold = open(file, O_WRONLY | O_NONBLOCK);
+    snprintf(file, sizeof(file), "%s/sys/class/thermal/thermal_zone0/temp", root);
+    int fd_temp = open(file, O_WRONLY);
+    if (fd_pwm < 0 || fd_pwm_hold < 0 || fd_temp < 0)
+    {
+        printf("Failed to open fake sysfs, %s\n", strerror(errno));
+        return 1;
+    }
+
+    pid_t daemon_pid = fork();
+    if (daemon_pid == 0)
+    {
+        char conf[1024];
+        snprintf(conf, sizeof(conf), "%s/fan-control.json", root);
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(daemon_path, daemon_path, "-c", conf, "-r", root, (char *)NULL);
+        _exit(127);
+    }
+
+    start_workers();
+
+    unsigned long long start = now_us();
+    unsigned long long end = start + (unsigned long long)duration * 1000000;
+    unsigned long long step_end = start;
+    unsigned long long crossing = 0;
+    unsigned long long ticks0 = 0, vol0 = 0, invol0 = 0, ticks1 = 0, vol1 = 0, invol1 = 0;
+    unsigned long long base_us = 0;
+    long rss = 0, hwm = 0;
+    int step = -1;
+    int level = 0;
+    int writes = 0;
+
+    while (now_us() < end)
+    {
+        unsigned long long now = now_us();
+        if (now >= step_end)
+        {
+            char buff[32];
+            step = (step + 1) % script_num;
+            step_end = now + (unsigned long long)script[step].seconds * 1000000;
+            int len = snprintf(buff, sizeof(buff), "%-10d\n", script[step].temp * 1000);
+            int new_level = level_of(script[step].temp);
+            if (pwrite(fd_temp, buff, len, 0) != len)
+            {
+                printf("Failed to write temperature, %s\n", strerror(errno));
+            }
+
+            /* only upward crossings must act on the next sample, downward ones wait for hysteresis */
+            if (new_level > level && crossing == 0)
+            {
+                crossing = now;
+            }
+            level = new_level;
+        }
+
+        /* measure usage once the daemon has finished starting */
+        if (base_us == 0 && now - start > 2000000)
+        {
+            if (read_proc_usage(daemon_pid, &ticks0, &vol0, &invol0, &rss, &hwm) != 0)
+            {
+                printf("fan-control exited early, see %s/fan-control.log\n", root);
+                break;
+            }
+            base_us = now;
+        }
+
+        struct pollfd pfd = {fd_pwm, POLLIN, 0};
+        int timeout = (int)((step_end - now) / 1000) + 1;
+        if (poll(&pfd, 1, timeout > 100 ? 100 : timeout) > 0 && (pfd.revents & POLLIN))
+        {
+            char buff[64];
+            unsigned long long t = now_us();
+            if (read(fd_pwm, buff, sizeof(buff)) > 0)
+            {
+                writes++;
+                if (crossing != 0 && latency_num < MAX_SAMPLES)
+                {
+                    latency_ms[latency_num++] = (t - crossing) / 1000.0;
+                }
+                crossing = 0;
+            }
+        }
+    }
+
+    unsigned long long stop = now_us();
+    int ok = read_proc_usage(daemon_pid, &ticks1, &vol1, &invol1, &rss, &hwm) == 0 && base_us != 0;
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+    stop_workers();
+
+    if (!ok)
+    {
+        printf("Failed to sample fan-control usage.\n");
+        return 1;
+    }
+
+    double seconds = (stop - base_us) / 1000000.0;
+    qsort(latency_ms, latency_num, sizeof(latency_ms[0]), compare_double);
+    printf("duration          %.0fs, interval %dms, load%s%s%s%s\n", seconds, interval_ms, load_cpu ? " cpu" : "",
+           load_mem ? " mem" : "", load_io ? " io" : "", load_cpu || load_mem || load_io ? "" : " none");
+    printf("cpu time          %.3fs per hour\n", (double)(ticks1 - ticks0) / ticks_per_s * 3600 / seconds);
+    printf("wakeups           %.2f/s voluntary, %.2f/s involuntary\n", (vol1 - vol0) / seconds, (invol1 - invol0) / seconds);
+    printf("rss               %ld kB, peak %ld kB\n", rss, hwm);
+    printf("duty writes       %d\n", writes);
+    printf("crossing latency  %d samples, p50 %.1fms, p90 %.1fms, p99 %.1fms, max %.1fms\n", latency_num, percentile(50),
+           percentile(90), percentile(99), percentile(100));
+
+    if (!keep)
+    {
+        char cmd[1100];
+        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+        if (system(cmd) != 0)
+        {
+            printf("Failed to remove %s\n", root);
+        }
+    }
+    else
+    {
+        printf("fake sysfs        %s\n", root);
+    }
+
+    return 0;
+}
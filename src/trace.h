@@ -0,0 +1,102 @@
+/*
+MIT License
+
+Copyright (c) 2022 Nick Peng
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef _FAN_CONTROL_TRACE_H_
+#define _FAN_CONTROL_TRACE_H_
+
+/*
+ * Static user-space tracepoints (USDT) for bpftrace, perf and systemtap.
+ *
+ * Each probe is a nop in the code plus an entry in the .note.stapsdt ELF
+ * section, laid out as <sys/sdt.h> does, so no extra build dependency is
+ * needed. Arguments are passed as signed 64-bit values; strings as pointers,
+ * read them with str(argN). Every probe has a semaphore that tracers raise
+ * while attached, TRACE_ENABLED() guards work only done for the probe.
+ *
+ *   bpftrace -e 'usdt:/usr/sbin/fan-control:fan_control:decision { printf("%d -> %d\n", arg0, arg1); }'
+ *
+ * Build with TRACE=0 (FAN_CONTROL_NO_TRACE) to compile them out. They are
+ * also left out on targets other than 64-bit ELF with a GNU compatible compiler.
+ */
+
+#if !defined(FAN_CONTROL_NO_TRACE) && defined(__GNUC__) && defined(__ELF__) && defined(__LP64__)
+
+#define TRACE_SEMAPHORE(name) \
+    volatile unsigned short fan_control_##name##_semaphore __attribute__((section(".probes"), used))
+
+#define TRACE_ENABLED(name) __builtin_expect(fan_control_##name##_semaphore != 0, 0)
+
+#define _TRACE_NOTE(name, args)                                                 \
+    "990: nop\n"                                                                \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                               \
+    ".balign 4\n"                                                               \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+    "991: .asciz \"stapsdt\"\n"                                                 \
+    "992: .balign 4\n"                                                          \
+    "993: .8byte 990b\n"                                                        \
+    ".8byte _.stapsdt.base\n"                                                   \
+    ".8byte fan_control_" #name "_semaphore\n"                                  \
+    ".asciz \"fan_control\"\n"                                                  \
+    ".asciz \"" #name "\"\n"                                                    \
+    ".asciz \"" args "\"\n"                                                     \
+    "994: .balign 4\n"                                                          \
+    ".popsection\n"                                                             \
+    ".ifndef _.stapsdt.base\n"                                                  \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+    ".weak _.stapsdt.base\n"                                                    \
+    ".hidden _.stapsdt.base\n"                                                  \
+    "_.stapsdt.base: .space 1\n"                                                \
+    ".size _.stapsdt.base, 1\n"                                                 \
+    ".popsection\n"                                                             \
+    ".endif\n"
+
+#define _TRACE_ARG(x) "nor"((long long)(x))
+
+#define TRACE_PROBE2(name, a1, a2) \
+    __asm__ __volatile__(_TRACE_NOTE(name, "-8@%0 -8@%1") : : _TRACE_ARG(a1), _TRACE_ARG(a2))
+
+#define TRACE_PROBE3(name, a1, a2, a3) \
+    __asm__ __volatile__(_TRACE_NOTE(name, "-8@%0 -8@%1 -8@%2") : : _TRACE_ARG(a1), _TRACE_ARG(a2), _TRACE_ARG(a3))
+
+#else
+
+#define TRACE_SEMAPHORE(name) struct fan_control_##name##_semaphore
+#define TRACE_ENABLED(name) 0
+#define TRACE_PROBE2(name, a1, a2) \
+    do                             \
+    {                              \
+        (void)(a1);                \
+        (void)(a2);                \
+    } while (0)
+#define TRACE_PROBE3(name, a1, a2, a3) \
+    do                                 \
+    {                                  \
+        (void)(a1);                    \
+        (void)(a2);                    \
+        (void)(a3);                    \
+    } while (0)
+
+#endif
+
+#endif